@@ -0,0 +1,406 @@
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "evaluator.hpp"
+#include "bytecode.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
+#include <span>
+#include <string>
+#include <variant>
+#include <vector>
+
+/*
+usage : bench --scan [MiB]
+       bench --arena [lines]
+       bench --values [millions]
+       bench --arith [runs]
+--scan lexes generated sources of MiB each (default 32) with lexer::lex_span()
+       at every scan::level this CPU supports, best of 3 in MB/s :
+           mixed  = short numbers, identifiers and operators, one space apart
+           space  = the same lines behind deep indentation
+           digits = long integer literals
+--arena parses lines (default 200000) generated expressions with parser::Parser into a
+        util::Arena, and with the same Pratt loop into the unique_ptr tree the AST used to be,
+        best of 3 in nodes/s, plus the operator new calls per expression of a warm pass.
+--values runs millions (default 20) of int +/- through values::Value and evaluator::bin_expr::apply,
+         through the std::variant<std::monostate, int> valtype it replaced, and through
+         the heap hierarchy scratchpads/VALUES.md planned, best of 3 in ops/s,
+         plus sizeof and the operator new calls per op.
+--arith  compiles one chain of 64 ints joined by + and -, unfolded, and runs it runs times
+         (default 1000000) on bytecode::VM and on the tree walking Evaluator, best of 3
+         in million +/- per second, plus the operator new calls per run of the VM :
+             small = 48-bit inline ints, the fast path
+             wide  = ints past 2^47, boxed and overflow checked
+*/
+using bench_clock = std::chrono::steady_clock;
+
+// every operator new in the process, read around a pass
+static std::size_t allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++allocations;
+    if(void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+template <typename Fn>
+static double best_of_3(Fn&& fn) {
+    double best = 1e300;
+    for(int i = 0; i < 3; ++i) {
+        auto start = bench_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double>(bench_clock::now() - start).count());
+    }
+    return best;
+}
+
+// defeats dead code elimination of a result nobody reads
+template <typename T>
+static void keep(const T& val) {
+    asm volatile("" : : "g"(&val) : "memory");
+}
+
+enum class shape { MIXED, SPACE, DIGITS };
+
+static std::string make_source(shape kind, std::size_t bytes) {
+    std::mt19937 rng(42);
+    std::string res;
+    res.reserve(bytes + 256);
+    const char* idents[] = {"x", "count", "total", "i"};
+    while(res.size() < bytes) {
+        if(kind == shape::SPACE) res.append(64 + rng() % 64, ' ');
+        int terms = 2 + rng() % 6;
+        for(int t = 0; t < terms; ++t) {
+            if(t) res += (rng() % 2) ? " + " : " - ";
+            if(kind == shape::DIGITS) {
+                for(int d = 0; d < 18; ++d) res += static_cast<char>('0' + rng() % 10);
+            } else if(rng() % 3 == 0) {
+                res += idents[rng() % 4];
+            } else {
+                res += std::to_string(rng() % 1000);
+            }
+        }
+        res += '\n';
+    }
+    return res;
+}
+
+static int bench_scan(std::size_t mib) {
+    const char* names[] = {"scalar", "sse2", "avx2"};
+    auto top = scan::detect();
+    std::printf("%-8s", "input");
+    for(int lvl = 0; lvl <= static_cast<int>(top); ++lvl)
+        std::printf(" %12s", (std::string(names[lvl]) + "(MB/s)").c_str());
+    std::printf("\n");
+
+    const std::pair<const char*, shape> inputs[] = {
+        {"mixed", shape::MIXED}, {"space", shape::SPACE}, {"digits", shape::DIGITS}
+    };
+    for(auto [name, kind] : inputs) {
+        auto src = make_source(kind, mib << 20);
+        std::printf("%-8s", name);
+        for(int lvl = 0; lvl <= static_cast<int>(top); ++lvl) {
+            scan::set_level(static_cast<scan::level>(lvl));
+            std::size_t tokens = 0;
+            double secs = best_of_3([&] {
+                tokens = 0;
+                auto stop = lexer::lex_span(src.data(), src.data() + src.size(),
+                    [&tokens](basics::token_tag, const char*, const char*) { ++tokens; });
+                if(stop != src.data() + src.size()) std::abort();
+            });
+            keep(tokens);
+            std::printf(" %12.0f", src.size() / secs / 1e6);
+        }
+        std::printf("\n");
+    }
+    scan::set_level(top);
+    return 0;
+}
+
+// the AST before util::Arena : a node per operator new, children owned through unique_ptr
+namespace heap {
+
+struct Node {
+    virtual ~Node() = default;
+};
+
+struct Int : Node {
+    explicit Int(std::int64_t val) : val(val) {}
+    std::int64_t val;
+};
+
+struct Unary : Node {
+    Unary(std::unique_ptr<Node> rhs, basics::token_tag tag) : rhs(std::move(rhs)), tag(tag) {}
+    std::unique_ptr<Node> rhs;
+    basics::token_tag tag;
+};
+
+struct Bin : Node {
+    Bin(std::unique_ptr<Node> lhs, std::unique_ptr<Node> rhs, basics::token_tag tag)
+        : lhs(std::move(lhs)), rhs(std::move(rhs)), tag(tag) {}
+    std::unique_ptr<Node> lhs;
+    std::unique_ptr<Node> rhs;
+    basics::token_tag tag;
+};
+
+// parser::Parser's loop without its error paths, the input is known to be valid
+class Parser {
+    public :
+    std::unique_ptr<Node> parse(std::span<const basics::Token> tokens) {
+        this->it = tokens.data();
+        this->end = tokens.data() + tokens.size();
+        return expression(0);
+    }
+
+    private :
+    std::unique_ptr<Node> prefix(const basics::Token& tok) {
+        const auto& info = basics::get_info(tok.tag);
+        if(info.is_value) {
+            std::int64_t val = 0;
+            std::from_chars(tok.value.data(), tok.value.data() + tok.value.size(), val);
+            return std::make_unique<Int>(val);
+        }
+        return std::make_unique<Unary>(expression(info.prefix_bp), tok.tag);
+    }
+
+    std::unique_ptr<Node> expression(float min_bp) {
+        auto lhs = prefix(*this->it++);
+        while(this->it != this->end) {
+            auto [l_bp, r_bp] = basics::get_info(this->it->tag).bp;
+            if(l_bp < min_bp) break;
+            auto tag = (this->it++)->tag;
+            auto rhs = expression(r_bp);
+            lhs = std::make_unique<Bin>(std::move(lhs), std::move(rhs), tag);
+        }
+        return lhs;
+    }
+
+    const basics::Token* it = nullptr;
+    const basics::Token* end = nullptr;
+};
+
+}
+
+struct parsed_lines {
+    std::string src;
+    std::vector<std::string_view> lines;
+    std::vector<std::vector<basics::Token>> tokens;
+    std::size_t nodes = 0; // every token becomes exactly one node
+};
+
+// fills tokens, lines and nodes from src, which must lex
+static void lex_lines(parsed_lines& res) {
+    lexer::TokenStream stream;
+    if(!stream.lex(res.src)) std::abort();
+    for(std::size_t n = 0; n < stream.lines(); ++n) {
+        auto& toks = res.tokens.emplace_back();
+        for(std::size_t i = stream.line_first(n); i < stream.line_first(n + 1); ++i)
+            toks.push_back(stream[i]);
+        res.nodes += toks.size();
+        auto first = toks.front().value.data();
+        auto last = toks.back().value.data() + toks.back().value.size();
+        res.lines.emplace_back(first, last - first);
+    }
+}
+
+static void make_lines(parsed_lines& res, std::size_t count) {
+    std::mt19937 rng(42);
+    for(std::size_t n = 0; n < count; ++n) {
+        int terms = 2 + rng() % 15;
+        for(int t = 0; t < terms; ++t) {
+            if(t) res.src += (rng() % 2) ? " + " : " - ";
+            if(rng() % 4 == 0) res.src += '-';
+            res.src += std::to_string(rng() % 100000);
+        }
+        res.src += '\n';
+    }
+    lex_lines(res);
+}
+
+static int bench_arena(std::size_t count) {
+    parsed_lines input;
+    make_lines(input, count);
+    std::size_t lines = input.tokens.size();
+
+    util::Arena arena;
+    parser::Parser arena_parser;
+    auto arena_pass = [&] {
+        for(std::size_t n = 0; n < lines; ++n) {
+            arena.reset();
+            auto tree = arena_parser.parse(input.tokens[n], arena, input.lines[n]);
+            if(!tree) std::abort();
+            keep(*tree);
+        }
+    };
+    heap::Parser heap_parser;
+    auto heap_pass = [&] {
+        for(std::size_t n = 0; n < lines; ++n) {
+            auto tree = heap_parser.parse(input.tokens[n]);
+            keep(tree);
+        }
+    };
+
+    auto report = [&](const char* name, auto&& pass) {
+        double secs = best_of_3(pass);
+        std::size_t before = allocations;
+        pass();
+        double per_expr = double(allocations - before) / lines;
+        std::printf("%-12s %14.0f %14.2f\n", name, input.nodes / secs, per_expr);
+    };
+    std::printf("%-12s %14s %14s\n", "tree", "nodes/s", "allocs/expr");
+    report("arena", arena_pass);
+    report("unique_ptr", heap_pass);
+    return 0;
+}
+
+// the valtype before values::Value
+using variant_value = std::variant<std::monostate, int>;
+
+static basics::err_code variant_apply(bool plus, const variant_value& lhs, const variant_value& rhs, variant_value& out) {
+    auto* a = std::get_if<int>(&lhs);
+    auto* b = std::get_if<int>(&rhs);
+    if(!a || !b) return basics::err_code::NOT_NUMERIC;
+    out = plus ? (*a + *b) : (*a - *b);
+    return basics::err_code::NONE;
+}
+
+// scratchpads/VALUES.md : every result a new heap object, the type an enum behind a virtual call
+namespace hierarchy {
+
+enum class kind { NIL, NUMBER };
+
+struct RuntimeObject {
+    virtual ~RuntimeObject() = default;
+    virtual kind type() const noexcept = 0;
+};
+
+struct NumberValue : RuntimeObject {
+    static constexpr kind tag = kind::NUMBER;
+    explicit NumberValue(int val) : val(val) {}
+    kind type() const noexcept override { return tag; }
+    int val;
+};
+
+template <typename T>
+const T* downcast(const RuntimeObject* obj) noexcept {
+    return (obj && obj->type() == T::tag) ? static_cast<const T*>(obj) : nullptr;
+}
+
+using value = std::unique_ptr<RuntimeObject>;
+
+inline basics::err_code apply(bool plus, const value& lhs, const value& rhs, value& out) {
+    auto* a = downcast<NumberValue>(lhs.get());
+    auto* b = downcast<NumberValue>(rhs.get());
+    if(!a || !b) return basics::err_code::NOT_NUMERIC;
+    out = std::make_unique<NumberValue>(plus ? (a->val + b->val) : (a->val - b->val));
+    return basics::err_code::NONE;
+}
+
+}
+
+static int bench_values(std::size_t millions) {
+    // a[i + half] == -a[i], so the running sum stays small whatever the length
+    constexpr std::size_t width = 1024, half = width / 2;
+    std::mt19937 rng(42);
+    int operands[width];
+    for(std::size_t i = 0; i < half; ++i) {
+        operands[i] = static_cast<int>(rng() % 2001) - 1000;
+        operands[i + half] = -operands[i];
+    }
+    std::size_t ops = millions * 1000000;
+
+    std::vector<basics::valtype> boxed(operands, operands + width);
+    std::vector<variant_value> variants(operands, operands + width);
+    std::vector<hierarchy::value> objects;
+    for(int val : operands) objects.push_back(std::make_unique<hierarchy::NumberValue>(val));
+
+    auto run = [ops](auto& operands, auto acc, auto&& apply) {
+        for(std::size_t i = 0; i < ops; ++i)
+            if(apply(i & 1, acc, operands[i % width], acc) != basics::err_code::NONE) std::abort();
+        keep(acc);
+    };
+    auto report = [&](const char* name, std::size_t size, auto&& pass) {
+        double secs = best_of_3(pass);
+        std::size_t before = allocations;
+        pass();
+        std::printf("%-12s %6zu %14.0f %10.2f\n", name, size, ops / secs, double(allocations - before) / ops);
+    };
+
+    std::printf("%-12s %6s %14s %10s\n", "value", "bytes", "ops/s", "allocs/op");
+    report("nan-boxed", sizeof(basics::valtype), [&] {
+        run(boxed, basics::valtype(0), [](bool plus, auto& lhs, auto& rhs, auto& out) {
+            return evaluator::bin_expr::apply(plus ? basics::token_tag::PLUS : basics::token_tag::MINUS, lhs, rhs, out);
+        });
+    });
+    report("variant", sizeof(variant_value), [&] { run(variants, variant_value(0), variant_apply); });
+    // the owning pointer plus the object it points to
+    report("hierarchy", sizeof(hierarchy::value) + sizeof(hierarchy::NumberValue), [&] {
+        run(objects, hierarchy::value(std::make_unique<hierarchy::NumberValue>(0)), hierarchy::apply);
+    });
+    return 0;
+}
+
+static int bench_arith(std::size_t runs) {
+    constexpr int terms = 64;
+    std::printf("%-8s %12s %12s %14s\n", "ints", "vm(M/s)", "tree(M/s)", "vm allocs/run");
+    for(bool wide : {false, true}) {
+        // alternating signs keep the sum near the first term, no overflow either way
+        parsed_lines input;
+        std::mt19937 rng(42);
+        std::int64_t base = wide ? (std::int64_t(1) << 50) : 0;
+        for(int t = 0; t < terms; ++t) {
+            if(t) input.src += (t % 2) ? " + " : " - ";
+            input.src += std::to_string(base + rng() % 1000);
+        }
+        input.src += '\n';
+        lex_lines(input);
+
+        util::Arena arena;
+        parser::Parser parser_obj;
+        auto tree = parser_obj.parse(input.tokens[0], arena, input.lines[0]);
+        if(!tree || !*tree) std::abort();
+        bytecode::Chunk chunk;
+        bytecode::Compiler().compile(*tree, chunk);
+
+        bytecode::VM vm;
+        evaluator::Evaluator ev;
+        basics::valtype val;
+        auto vm_pass = [&] {
+            for(std::size_t i = 0; i < runs; ++i)
+                if(vm.run(chunk, &val)) std::abort();
+        };
+        auto tree_pass = [&] {
+            for(std::size_t i = 0; i < runs; ++i)
+                if((*tree)->accept(ev, &val)) std::abort();
+        };
+        double ops = double(runs) * (terms - 1);
+        double vm_secs = best_of_3(vm_pass);
+        double tree_secs = best_of_3(tree_pass);
+        std::size_t before = allocations;
+        vm.run(chunk, &val);
+        std::printf("%-8s %12.1f %12.1f %14zu\n", wide ? "wide" : "small",
+            ops / vm_secs / 1e6, ops / tree_secs / 1e6, allocations - before);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if(argc >= 2 && std::strcmp(argv[1], "--scan") == 0)
+        return bench_scan(argc >= 3 ? std::atoi(argv[2]) : 32);
+    if(argc >= 2 && std::strcmp(argv[1], "--arena") == 0)
+        return bench_arena(argc >= 3 ? std::atoi(argv[2]) : 200000);
+    if(argc >= 2 && std::strcmp(argv[1], "--values") == 0)
+        return bench_values(argc >= 3 ? std::atoi(argv[2]) : 20);
+    if(argc >= 2 && std::strcmp(argv[1], "--arith") == 0)
+        return bench_arith(argc >= 3 ? std::atoi(argv[2]) : 1000000);
+    std::fprintf(stderr, "usage : bench --scan [MiB] | --arena [lines] | --values [millions] | --arith [runs]\n");
+    return 2;
+}
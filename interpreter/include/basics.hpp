@@ -1,9 +1,14 @@
+#pragma once
 #include <cstdint>
 #include <utility>
+#include <variant>
 #include <array>
 #include <stdexcept>
 #include <string_view>
 #include "utilities.hpp"
+#include "dfa.hpp"
+#include "value.hpp"
+#include "symbols.hpp"
 
 /*
 Procedure = A one or more set of instructions packed within same context.
@@ -26,7 +31,7 @@ in our case, General Procedure includes classes of CST Nodes
 ##################################################
 
 namespaces :
-    util, basics, asts, evaluator, parser
+    util, basics, asts, evaluator, parser, bytecode, fold, values, symbols
 
 */
 
@@ -39,15 +44,17 @@ namespace basics {
 */
 
 
-using valtype = std::variant<std::monostate, int>;
+// 8-byte NaN-boxed value, see value.hpp
+using valtype = values::Value;
 
 using tag_base = std::uint8_t;
-enum class token_tag {
+enum class token_tag : tag_base {
     SENT,
     EOFILE,
     INTEGER,
     PLUS,
     MINUS,
+    IDENTIFIER,
     COUNT
 };
 
@@ -55,21 +62,60 @@ constexpr tag_base revert(token_tag tag) {
     return static_cast<tag_base>(tag);
 }
 
+/*
+bp is the (left, right) binding power of an infix operator, left < right is left associative.
+prefix_bp is how tight a prefix operator binds its operand, 0 when it is not one.
+*/
 struct tag_info {
     std::pair<float, float> bp = {};
     const char* name = "UNKNOWN";
     bool is_operator = false;
     bool is_value = false;
+    float prefix_bp = 0;
 };
 
 constexpr auto tag_table =
     util::sparse_array<tag_info, revert(token_tag::COUNT)>({
         {revert(token_tag::EOFILE), tag_info{{0, 0}, "EOFILE", false, false}},
         {revert(token_tag::INTEGER), tag_info{{0, 0}, "INTEGER", false, true}},
-        {revert(token_tag::PLUS), tag_info{{0, 0}, "PLUS", true, false}},
-        {revert(token_tag::MINUS), tag_info{{0, 0}, "MINUS", true, false}}
+        {revert(token_tag::PLUS), tag_info{{1.0f, 1.1f}, "PLUS", true, false, 2.0f}},
+        {revert(token_tag::MINUS), tag_info{{1.0f, 1.1f}, "MINUS", true, false, 2.0f}},
+        {revert(token_tag::IDENTIFIER), tag_info{{0, 0}, "IDENTIFIER", false, false}}
     });
 
+/*
+What the lexer recognizes, compiled into lexer::token_dfa at compile time.
+Longest match wins, on a tie the pattern declared first does.
+A new operator or keyword is one more literal entry here.
+*/
+using token_pattern = util::token_pattern<token_tag>;
+using util::pattern_edge;
+
+// digits ('.' digits?)? ([eE] [+-]? digits)?
+constexpr pattern_edge number_edges[] = {
+    {0, "0123456789", 1},
+    {1, "0123456789", 1}, {1, ".", 2}, {1, "eE", 3},
+    {2, "0123456789", 2}, {2, "eE", 3},
+    {3, "+-", 4}, {3, "0123456789", 5},
+    {4, "0123456789", 5},
+    {5, "0123456789", 5}
+};
+constexpr std::uint8_t number_accepting[] = {1, 2, 5};
+
+// [A-Za-z_] [A-Za-z0-9_]*
+constexpr pattern_edge identifier_edges[] = {
+    {0, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_", 1},
+    {1, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_0123456789", 1}
+};
+constexpr std::uint8_t identifier_accepting[] = {1};
+
+constexpr token_pattern token_patterns[] = {
+    {token_tag::INTEGER, nullptr, number_edges, number_accepting},
+    {token_tag::PLUS, "+"},
+    {token_tag::MINUS, "-"},
+    {token_tag::IDENTIFIER, nullptr, identifier_edges, identifier_accepting}
+};
+
 constexpr tag_info empty_info{};
 
 constexpr bool info_available(tag_base idx) {
@@ -92,9 +138,48 @@ constexpr const tag_info& get_info(token_tag tag) {
     return (info_available(idx) ?  tag_table[idx] : empty_info);
 }
 
+// sym is the interned id of an IDENTIFIER, symbols::none for anything else
 struct Token {
     token_tag tag;
     std::string_view value;
+    symbols::sym_t sym = symbols::none;
 };
 
+// bytes [first, first + length) of a line
+struct span {
+    std::uint32_t first = 0;
+    std::uint32_t length = 0;
+};
+
+enum class err_code : std::uint8_t {
+    NONE,
+    // lexer
+    LEX_INVALID,
+    // parser
+    UNEXPECTED_END,
+    EXPECTED_VALUE,
+    EXPECTED_OPERATOR,
+    NUMBER_RANGE,
+    TOO_DEEP,
+    // evaluator
+    INT_OVERFLOW,
+    NOT_NUMERIC,
+    NOT_AN_OPERATOR
+};
+
+/*
+What goes through the lexer, parser and evaluator on failure,
+a code, the token tag it is about and where. No text, the message
+and the caret line are built by diagnostic.hpp only when shown.
+line is filled in by whoever knows it, the evaluator leaves it 0.
+*/
+struct Error {
+    err_code code = err_code::NONE;
+    token_tag tag = token_tag::SENT;
+    std::uint32_t line = 0;
+    span at;
+};
+
+static_assert(sizeof(Error) <= 16);
+
 }
\ No newline at end of file
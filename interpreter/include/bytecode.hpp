@@ -0,0 +1,173 @@
+#pragma once
+#include "basics.hpp"
+#include "expression.hpp"
+#include "evaluator.hpp"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+/*
+Optional execution engine, an AST is lowered into a flat array of
+stack instructions and run by VM::run() in a single dispatch loop.
+evaluator::Evaluator stays the reference, both must agree on every
+result and every error message.
+*/
+namespace bytecode {
+
+enum class opcode : std::uint8_t {
+    PUSH,
+    ADD,
+    SUB,
+    NEG,
+    HALT
+};
+
+// PUSH's operand indexes Chunk::consts
+struct Instr {
+    opcode op;
+    std::uint32_t operand = 0;
+};
+
+struct Chunk {
+    std::vector<Instr> code;
+    std::vector<basics::span> spans; // source of code[i], only read on error
+    std::vector<basics::valtype> consts;
+    std::size_t depth = 0; // deepest the value stack gets
+};
+
+class Compiler {
+    public :
+
+    /*
+    root must not be null, the chunk ends with HALT.
+    chunk is overwritten, reusing one keeps its capacity, no allocation once warm.
+    */
+    void compile(const asts::Expr* root, Chunk& chunk) {
+        chunk.code.clear();
+        chunk.spans.clear();
+        chunk.consts.clear();
+        chunk.depth = 0;
+        this->depth = 0;
+        emit(chunk, root);
+        push(chunk, {opcode::HALT}, 0, root->at);
+    }
+
+    private :
+    void push(Chunk& chunk, Instr ins, int effect, basics::span at) {
+        chunk.code.push_back(ins);
+        chunk.spans.push_back(at);
+        this->depth += effect;
+        if(this->depth > chunk.depth) chunk.depth = this->depth;
+    }
+
+    void constant(Chunk& chunk, basics::valtype val, basics::span at) {
+        push(chunk, {opcode::PUSH, static_cast<std::uint32_t>(chunk.consts.size())}, 1, at);
+        chunk.consts.push_back(std::move(val));
+    }
+
+    void emit(Chunk& chunk, const asts::Expr* node) {
+        switch(node->kind) {
+            case asts::expr_kind::INT :
+                constant(chunk, static_cast<const asts::IntExpr*>(node)->val, node->at);
+                break;
+            case asts::expr_kind::FLOAT :
+                constant(chunk, static_cast<const asts::FloatExpr*>(node)->val, node->at);
+                break;
+            case asts::expr_kind::BINARY : {
+                // the left spine in a loop, a flat `1 + 1 + ...` is as deep as it is long
+                std::size_t base = this->spine.size();
+                const asts::Expr* leftmost = node;
+                while(leftmost->kind == asts::expr_kind::BINARY) {
+                    auto* bin = static_cast<const asts::BinExpr*>(leftmost);
+                    this->spine.push_back(bin);
+                    leftmost = bin->lhs;
+                }
+                emit(chunk, leftmost);
+                while(this->spine.size() > base) {
+                    auto* bin = this->spine.back();
+                    this->spine.pop_back();
+                    emit(chunk, bin->rhs);
+                    push(chunk, {(bin->tag == basics::token_tag::PLUS) ? opcode::ADD : opcode::SUB}, -1, bin->at);
+                }
+                break;
+            }
+            case asts::expr_kind::UNARY : {
+                auto* un = static_cast<const asts::UnaryExpr*>(node);
+                emit(chunk, un->rhs);
+                // unary PLUS is the identity, nothing to run
+                if(un->tag == basics::token_tag::MINUS)
+                    push(chunk, {opcode::NEG}, 0, node->at);
+                break;
+            }
+        }
+    }
+
+    std::size_t depth = 0;
+    std::vector<const asts::BinExpr*> spine; // BinExprs whose rhs is still to emit, kept warm like Chunk
+};
+
+class VM {
+    public :
+
+    std::optional<basics::Error> run(const Chunk& chunk, basics::valtype* buf) {
+        if(this->stack.size() < chunk.depth)
+            this->stack.resize(chunk.depth);
+        // sp points one past the top, the compiler guarantees it stays in range
+        basics::valtype* sp = this->stack.data();
+        const basics::valtype* consts = chunk.consts.data();
+        const Instr* ip = chunk.code.data();
+        basics::err_code code = basics::err_code::NONE;
+
+#if defined(__GNUC__) && !defined(BYTECODE_SWITCH_DISPATCH)
+        static const void* labels[] = {&&op_PUSH, &&op_ADD, &&op_SUB, &&op_NEG, &&op_HALT};
+        #define VM_CASE(name) op_##name
+        #define VM_NEXT() goto *labels[static_cast<std::uint8_t>(ip->op)]
+        VM_NEXT();
+        {
+#else
+        #define VM_CASE(name) case opcode::name
+        #define VM_NEXT() continue
+        for(;;) switch(ip->op) {
+#endif
+            VM_CASE(PUSH) :
+                *sp++ = consts[ip->operand];
+                ++ip;
+                VM_NEXT();
+            VM_CASE(ADD) :
+                --sp;
+                // apply() inlines down to its small int fast path, the rest stays out of line
+                if((code = evaluator::bin_expr::apply(basics::token_tag::PLUS, sp[-1], sp[0], sp[-1])) != basics::err_code::NONE)
+                    return fail(chunk, ip, code, basics::token_tag::PLUS);
+                ++ip;
+                VM_NEXT();
+            VM_CASE(SUB) :
+                --sp;
+                if((code = evaluator::bin_expr::apply(basics::token_tag::MINUS, sp[-1], sp[0], sp[-1])) != basics::err_code::NONE)
+                    return fail(chunk, ip, code, basics::token_tag::MINUS);
+                ++ip;
+                VM_NEXT();
+            VM_CASE(NEG) :
+                if(sp[-1].is_small_int()) [[likely]]
+                    sp[-1] = -sp[-1].as_small_int();
+                else if((code = evaluator::unary_expr::apply(basics::token_tag::MINUS, sp[-1], sp[-1])) != basics::err_code::NONE)
+                    return fail(chunk, ip, code, basics::token_tag::MINUS);
+                ++ip;
+                VM_NEXT();
+            VM_CASE(HALT) :
+                *buf = sp[-1];
+                return std::nullopt;
+        }
+        #undef VM_CASE
+        #undef VM_NEXT
+        return std::nullopt;
+    }
+
+    private :
+    static basics::Error fail(const Chunk& chunk, const Instr* ip, basics::err_code code, basics::token_tag tag) {
+        return basics::Error{code, tag, 0, chunk.spans[ip - chunk.code.data()]};
+    }
+
+    std::vector<basics::valtype> stack;
+};
+
+}
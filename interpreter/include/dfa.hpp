@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+
+/*
+Compile-time lexer generator.
+
+Patterns are either an exact literal or a small hand-written automaton
+(edges over byte sets, from state 0). They are laid side by side as one NFA
+and turned into a DFA by subset construction, all in constexpr.
+When a DFA state accepts for several patterns the one declared first wins.
+
+The result is a dense [state][byte] table, so the lexer does exactly one
+lookup per input byte.
+*/
+namespace util {
+
+struct pattern_edge {
+    std::uint8_t from;
+    const char* chars; // any byte of this string moves from -> to
+    std::uint8_t to;
+};
+
+template <typename Tag>
+struct token_pattern {
+    Tag tag;
+    const char* literal = nullptr;
+    std::span<const pattern_edge> edges = {};
+    std::span<const std::uint8_t> accepting = {};
+};
+
+template <typename Tag, std::size_t States>
+struct dfa_table {
+    static constexpr std::uint8_t dead = 0xFF;
+    static constexpr std::uint8_t start = 0;
+
+    std::array<std::array<std::uint8_t, 256>, States> next{};
+    std::array<Tag, States> accept{}; // Tag{} = not accepting
+    std::array<bool, States> digit_loop{}; // every digit loops back, the lexer may skip digit runs in bulk
+
+    static constexpr std::size_t size() { return States; }
+};
+
+namespace dfa_detail {
+
+constexpr std::size_t max_nfa = 64;
+constexpr std::size_t max_edges = 128;
+constexpr std::size_t max_dfa = 64;
+
+using byteset = std::array<std::uint64_t, 4>;
+using stateset = std::uint64_t;
+
+constexpr bool has(const byteset& set, unsigned char c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+constexpr void add(byteset& set, unsigned char c) {
+    set[c >> 6] |= std::uint64_t{1} << (c & 63);
+}
+
+struct nfa_edge {
+    std::uint8_t from;
+    std::uint8_t to;
+    byteset on;
+};
+
+template <typename Tag>
+struct nfa {
+    std::size_t states = 0;
+    std::size_t edge_count = 0;
+    std::array<nfa_edge, max_edges> edges{};
+    std::array<Tag, max_nfa> accept{};
+    std::array<std::size_t, max_nfa> priority{};
+    stateset starts = 0;
+
+    constexpr void edge(std::size_t from, std::size_t to, byteset on) {
+        if(edge_count >= max_edges) throw std::length_error("dfa : too many pattern edges");
+        edges[edge_count++] = {static_cast<std::uint8_t>(from), static_cast<std::uint8_t>(to), on};
+    }
+};
+
+template <typename Tag, std::size_t N>
+constexpr nfa<Tag> build_nfa(const token_pattern<Tag> (&patterns)[N]) {
+    nfa<Tag> res;
+    for(std::size_t p = 0; p < N; p++) {
+        const auto& pat = patterns[p];
+        std::size_t base = res.states;
+        std::size_t used = 1;
+        res.starts |= stateset{1} << base;
+
+        if(pat.literal) {
+            for(const char* c = pat.literal; *c; ++c, ++used) {
+                byteset on{};
+                add(on, static_cast<unsigned char>(*c));
+                res.edge(base + used - 1, base + used, on);
+            }
+            if(base + used > max_nfa) throw std::length_error("dfa : too many pattern states");
+            res.accept[base + used - 1] = pat.tag;
+            res.priority[base + used - 1] = p;
+        } else {
+            for(const auto& e : pat.edges) {
+                byteset on{};
+                for(const char* c = e.chars; *c; ++c)
+                    add(on, static_cast<unsigned char>(*c));
+                res.edge(base + e.from, base + e.to, on);
+                used = std::max<std::size_t>(used, std::max(e.from, e.to) + 1);
+            }
+            if(base + used > max_nfa) throw std::length_error("dfa : too many pattern states");
+            for(auto a : pat.accepting) {
+                res.accept[base + a] = pat.tag;
+                res.priority[base + a] = p;
+            }
+        }
+        res.states = base + used;
+    }
+    return res;
+}
+
+template <typename Tag>
+struct raw_dfa {
+    std::size_t states = 0;
+    dfa_table<Tag, max_dfa> table{};
+};
+
+template <typename Tag, std::size_t N>
+constexpr raw_dfa<Tag> build_raw(const token_pattern<Tag> (&patterns)[N]) {
+    auto n = build_nfa(patterns);
+    raw_dfa<Tag> res;
+    std::array<stateset, max_dfa> sets{};
+    sets[0] = n.starts;
+    res.states = 1;
+
+    for(std::size_t s = 0; s < res.states; s++) {
+        std::size_t best = SIZE_MAX;
+        for(std::size_t q = 0; q < n.states; q++) {
+            if(!((sets[s] >> q) & 1) || n.accept[q] == Tag{} || n.priority[q] >= best) continue;
+            best = n.priority[q];
+            res.table.accept[s] = n.accept[q];
+        }
+
+        for(std::size_t c = 0; c < 256; c++) {
+            stateset to = 0;
+            for(std::size_t e = 0; e < n.edge_count; e++) {
+                const auto& edge = n.edges[e];
+                if(((sets[s] >> edge.from) & 1) && has(edge.on, static_cast<unsigned char>(c)))
+                    to |= stateset{1} << edge.to;
+            }
+            if(!to) {
+                res.table.next[s][c] = dfa_table<Tag, max_dfa>::dead;
+                continue;
+            }
+
+            std::size_t found = 0;
+            while(found < res.states && sets[found] != to) ++found;
+            if(found == res.states) {
+                if(res.states >= max_dfa) throw std::length_error("dfa : too many DFA states");
+                sets[res.states++] = to;
+            }
+            res.table.next[s][c] = static_cast<std::uint8_t>(found);
+        }
+
+        bool loop = true;
+        for(char c = '0'; c <= '9'; c++)
+            loop = loop && res.table.next[s][static_cast<unsigned char>(c)] == s;
+        res.table.digit_loop[s] = loop;
+    }
+    return res;
+}
+
+}
+
+template <std::size_t States, typename Tag>
+constexpr dfa_table<Tag, States> shrink_dfa(const dfa_detail::raw_dfa<Tag>& raw) {
+    dfa_table<Tag, States> res;
+    for(std::size_t s = 0; s < States; s++) {
+        res.next[s] = raw.table.next[s];
+        res.accept[s] = raw.table.accept[s];
+        res.digit_loop[s] = raw.table.digit_loop[s];
+    }
+    return res;
+}
+
+// util::make_dfa<token_patterns>() : table sized to exactly the states it needs
+template <const auto& Patterns>
+constexpr auto make_dfa() {
+    constexpr auto raw = dfa_detail::build_raw(Patterns);
+    return shrink_dfa<raw.states>(raw);
+}
+
+}
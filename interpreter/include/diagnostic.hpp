@@ -0,0 +1,72 @@
+#pragma once
+#include "basics.hpp"
+#include <string>
+#include <string_view>
+
+/*
+Text for a basics::Error, built only when someone is about to show it.
+Nothing on the success path includes or calls this.
+*/
+namespace basics {
+
+inline const char* stage_of(err_code code) {
+    switch(code) {
+        case err_code::LEX_INVALID :
+            return "Lexer";
+        case err_code::UNEXPECTED_END :
+        case err_code::EXPECTED_VALUE :
+        case err_code::EXPECTED_OPERATOR :
+        case err_code::NUMBER_RANGE :
+        case err_code::TOO_DEEP :
+            return "Parser";
+        default :
+            return "Evaluator";
+    }
+}
+
+inline std::string message(const Error& err) {
+    std::string tag = get_info(err.tag).name;
+    switch(err.code) {
+        case err_code::NONE : return "no error";
+        case err_code::LEX_INVALID : return "Invalid syntax";
+        case err_code::UNEXPECTED_END : return "unexpected end of line";
+        case err_code::EXPECTED_VALUE : return "expected a value, got " + tag;
+        case err_code::EXPECTED_OPERATOR : return "expected an operator, got " + tag;
+        case err_code::NUMBER_RANGE : return "number out of range";
+        case err_code::TOO_DEEP : return "expression nested too deeply at " + tag;
+        case err_code::INT_OVERFLOW : return "integer overflow in " + tag;
+        case err_code::NOT_NUMERIC : return tag + " on a non-numeric value";
+        case err_code::NOT_AN_OPERATOR : return tag + " is not an operator here";
+    }
+    return "unknown error";
+}
+
+// one line, e.g. "Parser error : unexpected end of line, at line 3"
+inline std::string describe(const Error& err) {
+    std::string res = std::string(stage_of(err.code)) + " error : " + message(err);
+    if(err.line)
+        res += ", at line " + std::to_string(err.line);
+    return res;
+}
+
+/*
+describe() plus the offending line with a caret under the span :
+
+    Evaluator error : integer overflow in PLUS, at line 1
+     | 9223372036854775807 + 1
+     |                     ^
+*/
+inline std::string render(const Error& err, std::string_view line) {
+    std::string res = describe(err) + "\n | ";
+    res += line;
+    res += "\n | ";
+    // tabs stay tabs so the caret lines up
+    for(std::uint32_t i = 0; i < err.at.first; ++i)
+        res += (i < line.size() && line[i] == '\t') ? '\t' : ' ';
+    res += '^';
+    if(err.at.length > 1)
+        res.append(err.at.length - 1, '~');
+    return res;
+}
+
+}
@@ -1,16 +1,143 @@
 #pragma once
 #include "prototypes/evalclass.hpp"
 #include "basics.hpp"
+#include "expression.hpp"
 
 namespace evaluator {
-/*## TODO */
+
+/*
+Numeric tower : int64 and double, an int meeting a double becomes a double.
+Two 48-bit inline ints can't overflow an int64, that is the fast path,
+a single test and no allocation. Wider ints are checked and overflow is an error.
+*/
 namespace bin_expr {
 
-    
+    inline bool is_number(const basics::valtype& val) {
+        return val.is_double() || val.is_int();
+    }
+
+    inline double as_double(const basics::valtype& val) {
+        return val.is_double() ? val.as_double() : static_cast<double>(val.as_int());
+    }
+
+    // everything past the small int fast path, kept out of line so apply() stays small enough to inline
+    [[gnu::noinline]] inline basics::err_code apply_wide(
+        bool plus,
+        const basics::valtype& lhs,
+        const basics::valtype& rhs,
+        basics::valtype& out
+    ) {
+        if(!is_number(lhs) || !is_number(rhs))
+            return basics::err_code::NOT_NUMERIC;
+        if(lhs.is_int() && rhs.is_int()) {
+            std::int64_t res = 0;
+            bool overflowed = plus
+                ? __builtin_add_overflow(lhs.as_int(), rhs.as_int(), &res)
+                : __builtin_sub_overflow(lhs.as_int(), rhs.as_int(), &res);
+            if(overflowed) return basics::err_code::INT_OVERFLOW;
+            out = res;
+            return basics::err_code::NONE;
+        }
+        double a = as_double(lhs), b = as_double(rhs);
+        out = plus ? (a + b) : (a - b);
+        return basics::err_code::NONE;
+    }
+
+    // err_code::NONE on success, out may alias lhs or rhs
+    inline basics::err_code apply(
+        basics::token_tag tag,
+        const basics::valtype& lhs,
+        const basics::valtype& rhs,
+        basics::valtype& out
+    ) {
+        if((tag != basics::token_tag::PLUS) && (tag != basics::token_tag::MINUS))
+            return basics::err_code::NOT_AN_OPERATOR;
+        bool plus = (tag == basics::token_tag::PLUS);
+
+        // two 48-bit ints and a 48-bit result : the bits are written in place
+        if(lhs.is_small_int() && rhs.is_small_int()) [[likely]] {
+            std::int64_t a = lhs.small_int_high(), b = rhs.small_int_high();
+            std::int64_t res = 0;
+            bool overflowed = plus ? __builtin_add_overflow(a, b, &res) : __builtin_sub_overflow(a, b, &res);
+            if(!overflowed) [[likely]] {
+                out.set_small_int_high(res);
+                return basics::err_code::NONE;
+            }
+        }
+        return apply_wide(plus, lhs, rhs, out);
+    }
+
+}
+
+namespace unary_expr {
+
+    inline basics::err_code apply(basics::token_tag tag, const basics::valtype& rhs, basics::valtype& out) {
+        if((tag != basics::token_tag::PLUS) && (tag != basics::token_tag::MINUS))
+            return basics::err_code::NOT_AN_OPERATOR;
+        if(rhs.is_small_int()) [[likely]] {
+            out = (tag == basics::token_tag::MINUS) ? -rhs.as_small_int() : rhs.as_small_int();
+            return basics::err_code::NONE;
+        }
+        if(!bin_expr::is_number(rhs))
+            return basics::err_code::NOT_NUMERIC;
+        if(tag == basics::token_tag::PLUS) {
+            out = rhs;
+            return basics::err_code::NONE;
+        }
+        if(rhs.is_double()) {
+            out = -rhs.as_double();
+            return basics::err_code::NONE;
+        }
+        std::int64_t res = 0;
+        if(__builtin_sub_overflow(std::int64_t(0), rhs.as_int(), &res))
+            return basics::err_code::INT_OVERFLOW;
+        out = res;
+        return basics::err_code::NONE;
+    }
+
 }
 
+// the Error of a failed operation, pointing at its operator
+inline std::optional<basics::Error> fail(basics::err_code code, basics::token_tag tag, basics::span at) {
+    if(code == basics::err_code::NONE) [[likely]] return std::nullopt;
+    return basics::Error{code, tag, 0, at};
+}
 
+// the left spine in a loop, a flat `1 + 1 + ...` is as deep as it is long
+inline std::optional<basics::Error> Evaluator::visit(asts::BinExpr& obj, basics::valtype* buf) {
+    std::size_t base = this->spine.size();
+    asts::Expr* leftmost = &obj;
+    while(leftmost->kind == asts::expr_kind::BINARY) {
+        auto* bin = static_cast<asts::BinExpr*>(leftmost);
+        this->spine.push_back(bin);
+        leftmost = bin->lhs;
+    }
 
+    basics::valtype rhs;
+    auto err = leftmost->accept(*this, buf);
+    while(!err && this->spine.size() > base) {
+        auto* bin = this->spine.back();
+        this->spine.pop_back();
+        if((err = bin->rhs->accept(*this, &rhs))) break;
+        err = fail(bin_expr::apply(bin->tag, *buf, rhs, *buf), bin->tag, bin->at);
+    }
+    this->spine.resize(base);
+    return err;
+}
 
+inline std::optional<basics::Error> Evaluator::visit(asts::IntExpr& obj, basics::valtype* buf) {
+    *buf = obj.val;
+    return std::nullopt;
+}
 
-}
\ No newline at end of file
+inline std::optional<basics::Error> Evaluator::visit(asts::FloatExpr& obj, basics::valtype* buf) {
+    *buf = obj.val;
+    return std::nullopt;
+}
+
+inline std::optional<basics::Error> Evaluator::visit(asts::UnaryExpr& obj, basics::valtype* buf) {
+    if(auto err = obj.rhs->accept(*this, buf)) return err;
+    return fail(unary_expr::apply(obj.tag, *buf, *buf), obj.tag, obj.at);
+}
+
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include "prototypes/exprclass.hpp"
+#include "prototypes/evalclass.hpp"
+#include <basics.hpp>
+#include <utilities.hpp>
+#include <optional>
+#include <string>
+#include <charconv>
+#include <stdexcept>
+#include <cstdint>
+
+namespace bytecode { class Compiler; }
+namespace fold { class Folder; }
+
+/*
+Nodes live in a util::Arena and are handed around as plain pointers,
+the arena owns them, a whole tree goes away with Arena::reset().
+Their destructors never run, so a node must not own anything.
+*/
+namespace asts {
+
+using Evaluator = evaluator::Evaluator;
+
+// lets passes switch on a node instead of going through accept()
+enum class expr_kind : std::uint8_t {
+    INT,
+    FLOAT,
+    BINARY,
+    UNARY
+};
+
+class Expr {
+    public :
+
+    virtual std::optional<basics::Error> accept(Evaluator& ev, basics::valtype* buf) = 0;
+
+    virtual ~Expr() = default;
+
+    const expr_kind kind;
+    // source the node came from, the operator for BinExpr and UnaryExpr
+    basics::span at;
+
+    protected :
+    explicit Expr(expr_kind kind) : kind(kind) {}
+};
+
+class BinExpr : public Expr {
+    public :
+
+    static BinExpr* bin_expr(
+        util::Arena& arena,
+        Expr* lhs,
+        Expr* rhs,
+        basics::token_tag tag
+    ) {
+        if((tag != basics::token_tag::PLUS) && (tag != basics::token_tag::MINUS)) return nullptr;
+        if(!lhs || !rhs) return nullptr;
+        return new (arena.allocate(sizeof(BinExpr), alignof(BinExpr))) BinExpr(lhs, rhs, tag);
+    }
+
+    std::optional<basics::Error> accept(Evaluator& ev, basics::valtype* buf) override {
+        return ev.visit(*this, buf);
+    }
+
+    void set_lhs(Expr* ptr) {
+        if(!ptr)
+            throw std::invalid_argument("BinExpr::set_lhs() : lhs argument is empty");
+        this->lhs = ptr;
+    }
+
+    void set_rhs(Expr* ptr) {
+        if(!ptr)
+            throw std::invalid_argument("BinExpr::set_rhs() : rhs argument is empty");
+        this->rhs = ptr;
+    }
+
+    ~BinExpr() = default;
+
+    private :
+    friend Evaluator;
+    friend bytecode::Compiler;
+    friend fold::Folder;
+
+    BinExpr(Expr* lhs, Expr* rhs, basics::token_tag tag)
+        : Expr(expr_kind::BINARY), lhs(lhs), rhs(rhs), tag(tag) {}
+
+    Expr* lhs;
+    Expr* rhs;
+    basics::token_tag tag;
+};
+
+class IntExpr : public Expr {
+    public :
+
+    // nullptr when tok isn't an INTEGER or doesn't fit in an int64
+    static IntExpr* int_expr(util::Arena& arena, const basics::Token& tok) {
+        if(tok.tag != basics::token_tag::INTEGER) return nullptr;
+        std::int64_t buf = 0;
+        const char* first = tok.value.data();
+        const char* last = first + tok.value.size();
+        auto res = std::from_chars(first, last, buf);
+        if(res.ec != std::errc{} || res.ptr != last) return nullptr;
+        return new (arena.allocate(sizeof(IntExpr), alignof(IntExpr))) IntExpr(buf);
+    }
+
+    std::optional<basics::Error> accept(Evaluator& ev, basics::valtype* buf) override {
+        return ev.visit(*this, buf);
+    }
+
+    ~IntExpr() = default;
+
+    std::int64_t val;
+
+    private :
+    explicit IntExpr(std::int64_t val) : Expr(expr_kind::INT), val(val) {}
+};
+
+class FloatExpr : public Expr {
+    public :
+
+    // nullptr when tok isn't an INTEGER or is out of a double's range
+    static FloatExpr* float_expr(util::Arena& arena, const basics::Token& tok) {
+        if(tok.tag != basics::token_tag::INTEGER) return nullptr;
+        double buf = 0;
+        const char* first = tok.value.data();
+        const char* last = first + tok.value.size();
+        auto res = std::from_chars(first, last, buf);
+        if(res.ec != std::errc{} || res.ptr != last) return nullptr;
+        return new (arena.allocate(sizeof(FloatExpr), alignof(FloatExpr))) FloatExpr(buf);
+    }
+
+    std::optional<basics::Error> accept(Evaluator& ev, basics::valtype* buf) override {
+        return ev.visit(*this, buf);
+    }
+
+    ~FloatExpr() = default;
+
+    double val;
+
+    private :
+    explicit FloatExpr(double val) : Expr(expr_kind::FLOAT), val(val) {}
+};
+
+// a literal with a fraction or an exponent is a FloatExpr, anything else an IntExpr
+inline Expr* number_expr(util::Arena& arena, const basics::Token& tok) {
+    if(tok.value.find_first_of(".eE") != std::string_view::npos)
+        return FloatExpr::float_expr(arena, tok);
+    return IntExpr::int_expr(arena, tok);
+}
+
+class UnaryExpr : public Expr {
+    public :
+
+    static UnaryExpr* unary_expr(
+        util::Arena& arena,
+        Expr* rhs,
+        basics::token_tag tag
+    ) {
+        if((tag != basics::token_tag::PLUS) && (tag != basics::token_tag::MINUS)) return nullptr;
+        if(!rhs) return nullptr;
+        return new (arena.allocate(sizeof(UnaryExpr), alignof(UnaryExpr))) UnaryExpr(rhs, tag);
+    }
+
+    std::optional<basics::Error> accept(Evaluator& ev, basics::valtype* buf) override {
+        return ev.visit(*this, buf);
+    }
+
+    ~UnaryExpr() = default;
+
+    void set_rhs(Expr* ptr) {
+        if(!ptr)
+            throw std::invalid_argument("UnaryExpr::set_rhs() : rhs argument is empty");
+        this->rhs = ptr;
+    }
+
+
+    private :
+    friend Evaluator;
+    friend bytecode::Compiler;
+    friend fold::Folder;
+
+    UnaryExpr(Expr* rhs, basics::token_tag tag) : Expr(expr_kind::UNARY), rhs(rhs), tag(tag) {}
+
+    Expr* rhs;
+    basics::token_tag tag;
+};
+
+}
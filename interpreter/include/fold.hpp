@@ -0,0 +1,159 @@
+#pragma once
+#include "basics.hpp"
+#include "expression.hpp"
+#include "evaluator.hpp"
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/*
+Constant folding and simplification over an asts tree, rewritten in place.
+Anything that would raise at runtime (e.g. overflow) is left unfolded,
+so the error still surfaces when the line runs, with the same message.
+*/
+namespace fold {
+
+class Folder {
+    public :
+
+    // returns the new root, root itself may have been dropped
+    asts::Expr* run(asts::Expr* root) {
+        this->removed = 0;
+        return simplify(root).node;
+    }
+
+    // nodes dropped by the last run()
+    std::size_t eliminated() const noexcept { return removed; }
+
+    private :
+    // int_only : every leaf below is an IntExpr, so the result is an int
+    struct folded {
+        asts::Expr* node;
+        bool int_only;
+    };
+
+    static bool literal(const asts::Expr* node, basics::valtype& out) {
+        if(node->kind == asts::expr_kind::INT)
+            out = static_cast<const asts::IntExpr*>(node)->val;
+        else if(node->kind == asts::expr_kind::FLOAT)
+            out = static_cast<const asts::FloatExpr*>(node)->val;
+        else
+            return false;
+        return true;
+    }
+
+    // writes val into whichever literal has its type, folding never changes a node's kind
+    static asts::Expr* store(asts::Expr* first, asts::Expr* second, const basics::valtype& val) {
+        auto want = val.is_double() ? asts::expr_kind::FLOAT : asts::expr_kind::INT;
+        auto* node = (first->kind == want) ? first : second;
+        if(want == asts::expr_kind::FLOAT)
+            static_cast<asts::FloatExpr*>(node)->val = val.as_double();
+        else
+            static_cast<asts::IntExpr*>(node)->val = val.as_int();
+        return node;
+    }
+
+    static asts::UnaryExpr* as_neg(asts::Expr* node) {
+        if(node->kind != asts::expr_kind::UNARY) return nullptr;
+        auto* un = static_cast<asts::UnaryExpr*>(node);
+        return (un->tag == basics::token_tag::MINUS) ? un : nullptr;
+    }
+
+    static bool is_zero(asts::Expr* node) {
+        return node->kind == asts::expr_kind::INT && static_cast<asts::IntExpr*>(node)->val == 0;
+    }
+
+    /*
+    - -x is x unless x is INT64_MIN, then the outer negation overflows.
+    A literal says so itself, and a negation that succeeded
+    can't produce INT64_MIN, its operand would have to be INT64_MIN's opposite.
+    */
+    static bool never_int_min(asts::Expr* node) {
+        if(node->kind == asts::expr_kind::FLOAT) return true;
+        if(node->kind == asts::expr_kind::INT)
+            return static_cast<asts::IntExpr*>(node)->val != std::numeric_limits<std::int64_t>::min();
+        return as_neg(node) != nullptr;
+    }
+
+    folded simplify(asts::Expr* node) {
+        switch(node->kind) {
+            case asts::expr_kind::INT :
+                return {node, true};
+            case asts::expr_kind::FLOAT :
+                return {node, false};
+            case asts::expr_kind::UNARY :
+                return simplify(static_cast<asts::UnaryExpr*>(node));
+            case asts::expr_kind::BINARY :
+                return simplify(static_cast<asts::BinExpr*>(node));
+        }
+        return {node, false};
+    }
+
+    folded simplify(asts::UnaryExpr* node) {
+        auto [rhs, int_only] = simplify(node->rhs);
+        node->rhs = rhs;
+        if(node->tag == basics::token_tag::PLUS) {
+            ++this->removed;
+            return {rhs, int_only};
+        }
+        if(basics::valtype val; literal(rhs, val)) {
+            if(evaluator::unary_expr::apply(node->tag, val, val) != basics::err_code::NONE) return {node, int_only};
+            ++this->removed;
+            return {store(rhs, rhs, val), int_only};
+        }
+        if(auto* inner = as_neg(rhs); inner && never_int_min(inner->rhs)) {
+            this->removed += 2;
+            return {inner->rhs, int_only};
+        }
+        return {node, int_only};
+    }
+
+    // the left spine in a loop, a flat `1 + 1 + ...` is as deep as it is long
+    folded simplify(asts::BinExpr* node) {
+        std::size_t base = this->spine.size();
+        asts::Expr* leftmost = node;
+        while(leftmost->kind == asts::expr_kind::BINARY) {
+            auto* bin = static_cast<asts::BinExpr*>(leftmost);
+            this->spine.push_back(bin);
+            leftmost = bin->lhs;
+        }
+
+        auto lhs = simplify(leftmost);
+        while(this->spine.size() > base) {
+            auto* bin = this->spine.back();
+            this->spine.pop_back();
+            lhs = combine(bin, lhs, simplify(bin->rhs));
+        }
+        return lhs;
+    }
+
+    // node with both operands already simplified
+    folded combine(asts::BinExpr* node, folded lhs, folded rhs) {
+        node->lhs = lhs.node;
+        node->rhs = rhs.node;
+        bool int_only = lhs.int_only && rhs.int_only;
+
+        basics::valtype a, b;
+        if(literal(lhs.node, a) && literal(rhs.node, b)) {
+            if(evaluator::bin_expr::apply(node->tag, a, b, a) != basics::err_code::NONE) return {node, int_only};
+            this->removed += 2;
+            return {store(lhs.node, rhs.node, a), int_only};
+        }
+        // x + 0, 0 + x and x - 0 on ints only, for a double -0.0 + 0 is 0.0
+        if(!int_only) return {node, int_only};
+        if(is_zero(rhs.node)) {
+            this->removed += 2;
+            return {lhs.node, int_only};
+        }
+        if(node->tag == basics::token_tag::PLUS && is_zero(lhs.node)) {
+            this->removed += 2;
+            return {rhs.node, int_only};
+        }
+        return {node, int_only};
+    }
+
+    std::size_t removed = 0;
+    std::vector<asts::BinExpr*> spine; // BinExprs whose rhs is still to simplify
+};
+
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "basics.hpp"
+#include "utilities.hpp"
+#include "expression.hpp"
+#include <expected>
+#include <span>
+#include <string_view>
+
+namespace parser {
+
+/*
+Pratt parser, every precedence and associativity decision comes from
+basics::tag_table (bp for infix, prefix_bp for prefix operators),
+a new operator is a new tag_table entry, not a new grammar rule.
+Nodes are built in the arena passed to parse(), the tree is valid until it is reset.
+Every prefix operator and every right operand is one C++ call deeper, here and in
+each pass that walks the tree, so nesting past max_nesting is a TOO_DEEP error.
+A flat `1 + 1 + ...` only grows the left spine, which the passes walk in a loop.
+*/
+class Parser {
+    public :
+    static constexpr std::size_t max_nesting = 1000;
+
+    Parser() = default;
+
+    /*
+    line is the text the tokens view into, node spans are offsets into it.
+    nullptr on an empty line.
+    */
+    std::expected<asts::Expr*, basics::Error> parse(
+        std::span<const basics::Token> tokens,
+        util::Arena& arena,
+        std::string_view line
+    ) {
+        this->it = tokens.data();
+        this->end = tokens.data() + tokens.size();
+        this->arena = &arena;
+        this->line = line;
+        this->nesting = 0;
+        if(this->it == this->end) return nullptr;
+        // parsing is repetitive, errors are thrown inside and only surface here
+        try {
+            auto* root = expression(0);
+            if(this->it != this->end)
+                throw parse_error{error(basics::err_code::EXPECTED_OPERATOR, *this->it)};
+            return root;
+        } catch(const parse_error& err) {
+            return std::unexpected(err.err);
+        }
+    }
+
+    private :
+    struct parse_error {
+        basics::Error err;
+    };
+
+    basics::span span_of(const basics::Token& tok) const noexcept {
+        return {
+            static_cast<std::uint32_t>(tok.value.data() - this->line.data()),
+            static_cast<std::uint32_t>(tok.value.size())
+        };
+    }
+
+    basics::Error error(basics::err_code code, const basics::Token& tok) const noexcept {
+        return {code, tok.tag, 0, span_of(tok)};
+    }
+
+    const basics::Token& next() {
+        if(this->it == this->end)
+            throw parse_error{{basics::err_code::UNEXPECTED_END, basics::token_tag::EOFILE, 0,
+                {static_cast<std::uint32_t>(this->line.size()), 1}}};
+        return *this->it++;
+    }
+
+    asts::Expr* prefix(const basics::Token& tok) {
+        const auto& info = basics::get_info(tok.tag);
+        asts::Expr* node = nullptr;
+        if(info.is_value) {
+            node = asts::number_expr(*this->arena, tok);
+            if(!node)
+                throw parse_error{error(basics::err_code::NUMBER_RANGE, tok)};
+        } else if(info.prefix_bp > 0) {
+            auto* rhs = nested(info.prefix_bp, tok);
+            node = asts::UnaryExpr::unary_expr(*this->arena, rhs, tok.tag);
+        } else {
+            throw parse_error{error(basics::err_code::EXPECTED_VALUE, tok)};
+        }
+        node->at = span_of(tok);
+        return node;
+    }
+
+    asts::Expr* expression(float min_bp) {
+        asts::Expr* lhs = prefix(next());
+        while(this->it != this->end) {
+            const auto& info = basics::get_info(this->it->tag);
+            if(!info.is_operator)
+                throw parse_error{error(basics::err_code::EXPECTED_OPERATOR, *this->it)};
+            auto [l_bp, r_bp] = info.bp;
+            if(l_bp < min_bp) break;
+            const auto& op = next();
+            auto* rhs = nested(r_bp, op);
+            lhs = asts::BinExpr::bin_expr(*this->arena, lhs, rhs, op.tag);
+            lhs->at = span_of(op);
+        }
+        return lhs;
+    }
+
+    // the operand of op, one level deeper
+    asts::Expr* nested(float min_bp, const basics::Token& op) {
+        if(++this->nesting > max_nesting)
+            throw parse_error{error(basics::err_code::TOO_DEEP, op)};
+        auto* node = expression(min_bp);
+        --this->nesting;
+        return node;
+    }
+
+    const basics::Token* it = nullptr;
+    const basics::Token* end = nullptr;
+    util::Arena* arena = nullptr;
+    std::string_view line;
+    std::size_t nesting = 0;
+};
+
+}
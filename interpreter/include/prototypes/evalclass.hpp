@@ -1,7 +1,6 @@
 #pragma once
 #include <optional>
-#include <string>
-#include <variant>
+#include <vector>
 #include "exprclass.hpp"
 #include "../basics.hpp"
 
@@ -9,9 +8,13 @@ namespace evaluator {
 
 class Evaluator {
     public :
-    std::optional<std::string> visit(asts::BinExpr& obj, basics::valtype* buf);
-    std::optional<std::string> visit(asts::IntExpr& obj, basics::valtype* buf);
-    std::optional<std::string> visit(asts::UnaryExpr& obj, basics::valtype* buf);
+    std::optional<basics::Error> visit(asts::BinExpr& obj, basics::valtype* buf);
+    std::optional<basics::Error> visit(asts::IntExpr& obj, basics::valtype* buf);
+    std::optional<basics::Error> visit(asts::FloatExpr& obj, basics::valtype* buf);
+    std::optional<basics::Error> visit(asts::UnaryExpr& obj, basics::valtype* buf);
+
+    private :
+    std::vector<asts::BinExpr*> spine; // BinExprs whose rhs is still to run, see visit(BinExpr&)
 };
 
 }
\ No newline at end of file
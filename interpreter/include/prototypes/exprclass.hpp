@@ -4,6 +4,7 @@ namespace asts {
 
 
 class IntExpr;
+class FloatExpr;
 class BinExpr;
 class UnaryExpr;
 
@@ -0,0 +1,224 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHELLY_SCAN_X86 1
+#endif
+
+/*
+Byte class scanning for the lexer hot loop.
+Every function returns the first byte in [it, end) that is NOT of the class,
+so a run of whitespace, digits or single-char operators is crossed
+16 (SSE2) or 32 (AVX2) bytes per step.
+Runs shorter than scalar_lead never reach a vector load, nor does
+the tail shorter than a vector, nothing is ever read past end.
+
+Classes match the scalar lexer in the "C" locale :
+    space = std::isspace = '\t' '\n' '\v' '\f' '\r' ' '
+    digit = std::isdigit = '0'..'9'
+*/
+namespace scan {
+
+enum class level {
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+inline level detect() noexcept {
+#ifdef SHELLY_SCAN_X86
+    if(__builtin_cpu_supports("avx2")) return level::AVX2;
+    if(__builtin_cpu_supports("sse2")) return level::SSE2;
+#endif
+    return level::SCALAR;
+}
+
+inline level& active() noexcept {
+    static level lvl = detect();
+    return lvl;
+}
+
+// forcing a level lower than detect() is always safe, higher is not
+inline void set_level(level lvl) noexcept { active() = lvl; }
+
+constexpr bool is_space(unsigned char c) { return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t'; }
+constexpr bool is_digit(unsigned char c) { return static_cast<unsigned char>(c - '0') <= 9; }
+
+template <std::size_t N>
+constexpr bool is_op(unsigned char c, const std::array<unsigned char, N>& ops) {
+    for(auto op : ops)
+        if(c == op) return true;
+    return false;
+}
+
+namespace scalar {
+
+inline const char* skip_space(const char* it, const char* end) noexcept {
+    while(it < end && is_space(*it)) ++it;
+    return it;
+}
+
+inline const char* skip_digits(const char* it, const char* end) noexcept {
+    while(it < end && is_digit(*it)) ++it;
+    return it;
+}
+
+template <std::size_t N>
+const char* skip_ops(const char* it, const char* end, const std::array<unsigned char, N>& ops) noexcept {
+    while(it < end && is_op(*it, ops)) ++it;
+    return it;
+}
+
+}
+
+#ifdef SHELLY_SCAN_X86
+namespace sse2 {
+
+// lanes where lo <= v <= lo + span, unsigned
+__attribute__((target("sse2")))
+inline __m128i in_range(__m128i v, char lo, char span) noexcept {
+    __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(span)), t);
+}
+
+__attribute__((target("sse2")))
+inline const char* skip_space(const char* it, const char* end) noexcept {
+    for(; end - it >= 16; it += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        __m128i hit = _mm_or_si128(in_range(v, '\t', '\r' - '\t'), _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        unsigned miss = ~static_cast<unsigned>(_mm_movemask_epi8(hit)) & 0xFFFFu;
+        if(miss) return it + __builtin_ctz(miss);
+    }
+    return scalar::skip_space(it, end);
+}
+
+__attribute__((target("sse2")))
+inline const char* skip_digits(const char* it, const char* end) noexcept {
+    for(; end - it >= 16; it += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        unsigned miss = ~static_cast<unsigned>(_mm_movemask_epi8(in_range(v, '0', 9))) & 0xFFFFu;
+        if(miss) return it + __builtin_ctz(miss);
+    }
+    return scalar::skip_digits(it, end);
+}
+
+template <std::size_t N>
+__attribute__((target("sse2")))
+const char* skip_ops(const char* it, const char* end, const std::array<unsigned char, N>& ops) noexcept {
+    for(; end - it >= 16; it += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(it));
+        __m128i hit = _mm_setzero_si128();
+        for(auto op : ops)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(op))));
+        unsigned miss = ~static_cast<unsigned>(_mm_movemask_epi8(hit)) & 0xFFFFu;
+        if(miss) return it + __builtin_ctz(miss);
+    }
+    return scalar::skip_ops(it, end, ops);
+}
+
+}
+
+namespace avx2 {
+
+__attribute__((target("avx2")))
+inline __m256i in_range(__m256i v, char lo, char span) noexcept {
+    __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(span)), t);
+}
+
+__attribute__((target("avx2")))
+inline const char* skip_space(const char* it, const char* end) noexcept {
+    for(; end - it >= 32; it += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+        __m256i hit = _mm256_or_si256(in_range(v, '\t', '\r' - '\t'), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        unsigned miss = ~static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if(miss) return it + __builtin_ctz(miss);
+    }
+    return sse2::skip_space(it, end);
+}
+
+__attribute__((target("avx2")))
+inline const char* skip_digits(const char* it, const char* end) noexcept {
+    for(; end - it >= 32; it += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+        unsigned miss = ~static_cast<unsigned>(_mm256_movemask_epi8(in_range(v, '0', 9)));
+        if(miss) return it + __builtin_ctz(miss);
+    }
+    return sse2::skip_digits(it, end);
+}
+
+template <std::size_t N>
+__attribute__((target("avx2")))
+const char* skip_ops(const char* it, const char* end, const std::array<unsigned char, N>& ops) noexcept {
+    for(; end - it >= 32; it += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(it));
+        __m256i hit = _mm256_setzero_si256();
+        for(auto op : ops)
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(static_cast<char>(op))));
+        unsigned miss = ~static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if(miss) return it + __builtin_ctz(miss);
+    }
+    return sse2::skip_ops(it, end, ops);
+}
+
+}
+#endif
+
+/*
+Most runs in real source are a byte or two, a vector load there costs more than
+it saves. The first scalar_lead bytes go through the scalar loop, only a run still
+going past them is handed to the vector path.
+*/
+constexpr std::ptrdiff_t scalar_lead = 8;
+
+inline const char* lead_end(const char* it, const char* end) noexcept {
+    return (end - it > scalar_lead) ? it + scalar_lead : end;
+}
+
+inline const char* skip_space(const char* it, const char* end) noexcept {
+    const char* lead = lead_end(it, end);
+    it = scalar::skip_space(it, lead);
+    if(it != lead) return it;
+#ifdef SHELLY_SCAN_X86
+    switch(active()) {
+    case level::AVX2 : return avx2::skip_space(it, end);
+    case level::SSE2 : return sse2::skip_space(it, end);
+    default : break;
+    }
+#endif
+    return scalar::skip_space(it, end);
+}
+
+inline const char* skip_digits(const char* it, const char* end) noexcept {
+    const char* lead = lead_end(it, end);
+    it = scalar::skip_digits(it, lead);
+    if(it != lead) return it;
+#ifdef SHELLY_SCAN_X86
+    switch(active()) {
+    case level::AVX2 : return avx2::skip_digits(it, end);
+    case level::SSE2 : return sse2::skip_digits(it, end);
+    default : break;
+    }
+#endif
+    return scalar::skip_digits(it, end);
+}
+
+template <std::size_t N>
+const char* skip_ops(const char* it, const char* end, const std::array<unsigned char, N>& ops) noexcept {
+    const char* lead = lead_end(it, end);
+    it = scalar::skip_ops(it, lead, ops);
+    if(it != lead) return it;
+#ifdef SHELLY_SCAN_X86
+    switch(active()) {
+    case level::AVX2 : return avx2::skip_ops(it, end, ops);
+    case level::SSE2 : return sse2::skip_ops(it, end, ops);
+    default : break;
+    }
+#endif
+    return scalar::skip_ops(it, end, ops);
+}
+
+}
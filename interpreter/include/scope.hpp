@@ -0,0 +1,198 @@
+#pragma once
+#include "basics.hpp"
+#include "symbols.hpp"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+Variable and environment store, a copy-on-write chain of scopes.
+
+A scope's own writes go to a private table, child() freezes that table
+into an immutable layer shared by parent and child, so a subshell, a function
+call or an in-process pipeline stage gets an isolated scope in O(1) :
+neither side sees what the other writes afterwards, nothing is copied.
+Lookups walk the chain, which is flattened once it gets deeper than max_depth.
+
+Variables are keyed by symbols::sym_t, names are only looked up to build envp.
+*/
+namespace scope {
+
+using symbols::sym_t;
+
+class Scope {
+    public :
+    Scope() = default;
+
+    Scope(Scope&&) = default;
+    Scope& operator=(Scope&&) = default;
+
+    // every NAME=value of env, interned and exported
+    static Scope from_environ(char** env) {
+        Scope res;
+        for(; env && *env; ++env) {
+            std::string_view var(*env);
+            auto eq = var.find('=');
+            if(eq == var.npos || eq == 0) continue;
+            auto sym = symbols::global().intern(var.substr(0, eq));
+            res.local[sym] = entry{basics::valtype(var.substr(eq + 1)), true, false};
+        }
+        return res;
+    }
+
+    // nullptr when unset
+    const basics::valtype* get(sym_t sym) const {
+        auto* ent = find(sym);
+        return ent ? &ent->val : nullptr;
+    }
+
+    bool is_exported(sym_t sym) const {
+        auto* ent = find(sym);
+        return ent && ent->exported;
+    }
+
+    // an exported variable stays exported
+    void set(sym_t sym, basics::valtype val) {
+        auto* old = find(sym);
+        bool exported = old && old->exported;
+        this->local[sym] = entry{std::move(val), exported, false};
+        if(exported) this->env_dirty = true;
+    }
+
+    // `export NAME`, an unset NAME is exported empty
+    void mark_exported(sym_t sym) {
+        auto* old = find(sym);
+        if(old && old->exported) return;
+        this->local[sym] = entry{old ? old->val : basics::valtype(std::string_view()), true, false};
+        this->env_dirty = true;
+    }
+
+    // shadows whatever a parent layer holds
+    void unset(sym_t sym) {
+        auto* old = find(sym);
+        if(!old) return;
+        if(old->exported) this->env_dirty = true;
+        this->local[sym] = entry{basics::valtype(), false, true};
+    }
+
+    /*
+    An isolated scope that starts out seeing everything this one does.
+    O(1) : this scope's table is frozen and shared, not copied,
+    the envp cache is shared too until either side exports something.
+    */
+    Scope child() {
+        freeze();
+        Scope res;
+        res.frozen = this->frozen;
+        res.env = this->env;
+        res.env_dirty = this->env_dirty;
+        return res;
+    }
+
+    /*
+    NAME=value of every exported variable, null terminated, what execve() takes.
+    Built on first use and cached until an exported variable changes,
+    the pointers stay valid until then.
+    */
+    char* const* envp() const {
+        if(this->env_dirty || !this->env) {
+            this->env = build_env();
+            this->env_dirty = false;
+        }
+        return this->env->ptrs.data();
+    }
+
+    private :
+    struct entry {
+        basics::valtype val;
+        bool exported = false;
+        bool removed = false; // unset here, hides the parents' value
+    };
+
+    using table = std::unordered_map<sym_t, entry>;
+
+    struct layer {
+        table vars;
+        std::shared_ptr<const layer> parent;
+        std::size_t depth = 1;
+    };
+
+    struct env_block {
+        std::string bytes;
+        std::vector<char*> ptrs;
+    };
+
+    // deeper chains are merged into one layer, lookups stay short
+    static constexpr std::size_t max_depth = 16;
+
+    const entry* find(sym_t sym) const {
+        if(auto it = this->local.find(sym); it != this->local.end())
+            return it->second.removed ? nullptr : &it->second;
+        for(auto* lay = this->frozen.get(); lay; lay = lay->parent.get()) {
+            if(auto it = lay->vars.find(sym); it != lay->vars.end())
+                return it->second.removed ? nullptr : &it->second;
+        }
+        return nullptr;
+    }
+
+    // calls fn(sym, entry) once for every visible variable
+    template <typename Fn>
+    void visible(Fn&& fn) const {
+        std::vector<bool> seen(symbols::global().size());
+        auto visit = [&](const table& vars) {
+            for(auto& [sym, ent] : vars) {
+                if(sym >= seen.size()) seen.resize(sym + 1);
+                if(seen[sym]) continue;
+                seen[sym] = true;
+                if(!ent.removed) fn(sym, ent);
+            }
+        };
+        visit(this->local);
+        for(auto* lay = this->frozen.get(); lay; lay = lay->parent.get())
+            visit(lay->vars);
+    }
+
+    void freeze() {
+        if(this->local.empty()) return;
+        auto lay = std::make_shared<layer>();
+        if(this->frozen && this->frozen->depth >= max_depth) {
+            // merged into a root layer, whoever still shares the old chain keeps it
+            visible([&lay](sym_t sym, const entry& ent) { lay->vars.emplace(sym, ent); });
+        } else {
+            lay->vars = std::move(this->local);
+            lay->parent = this->frozen;
+            lay->depth = this->frozen ? this->frozen->depth + 1 : 1;
+        }
+        this->local.clear();
+        this->frozen = std::move(lay);
+    }
+
+    std::shared_ptr<env_block> build_env() const {
+        auto block = std::make_shared<env_block>();
+        std::vector<std::size_t> starts;
+        visible([&](sym_t sym, const entry& ent) {
+            if(!ent.exported) return;
+            starts.push_back(block->bytes.size());
+            block->bytes += symbols::global().name(sym);
+            block->bytes += '=';
+            block->bytes += values::to_string(ent.val);
+            block->bytes += '\0';
+        });
+        // pointers only once bytes is done growing
+        block->ptrs.reserve(starts.size() + 1);
+        for(auto at : starts) block->ptrs.push_back(block->bytes.data() + at);
+        block->ptrs.push_back(nullptr);
+        return block;
+    }
+
+    table local;
+    std::shared_ptr<const layer> frozen;
+    mutable std::shared_ptr<env_block> env;
+    mutable bool env_dirty = true;
+};
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "utilities.hpp"
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+Every distinct identifier gets a dense 32-bit id the first time the lexer
+sees it, tables keyed by name can then be plain vectors indexed by id,
+and comparing two names is comparing two integers.
+Names are copied once into an arena, later occurrences cost nothing.
+Not thread safe, the interpreter lexes on one thread.
+*/
+namespace symbols {
+
+using sym_t = std::uint32_t;
+
+// no symbol, what a non-identifier Token carries
+constexpr sym_t none = 0;
+
+class Interner {
+    public :
+    Interner() : names(1) {}
+
+    Interner(const Interner&) = delete;
+    Interner& operator=(const Interner&) = delete;
+
+    sym_t intern(std::string_view name) {
+        if(auto it = this->ids.find(name); it != this->ids.end())
+            return it->second;
+        auto* bytes = static_cast<char*>(this->storage.allocate(name.size() ? name.size() : 1, 1));
+        std::memcpy(bytes, name.data(), name.size());
+        std::string_view kept(bytes, name.size());
+        auto id = static_cast<sym_t>(this->names.size());
+        this->names.push_back(kept);
+        this->ids.emplace(kept, id);
+        return id;
+    }
+
+    // none when name was never interned, doesn't add it
+    sym_t find(std::string_view name) const {
+        auto it = this->ids.find(name);
+        return (it == this->ids.end()) ? none : it->second;
+    }
+
+    // the view stays valid for the life of the interner
+    std::string_view name(sym_t id) const noexcept {
+        return (id < this->names.size()) ? this->names[id] : std::string_view();
+    }
+
+    // ids handed out so far, plus none, the size for a table indexed by id
+    std::size_t size() const noexcept { return names.size(); }
+
+    private :
+    util::Arena storage{4 * 1024};
+    std::vector<std::string_view> names;
+    std::unordered_map<std::string_view, sym_t, util::string_hash, std::equal_to<>> ids;
+};
+
+// the one the lexer interns into
+inline Interner& global() {
+    static Interner table;
+    return table;
+}
+
+}
@@ -1,6 +1,13 @@
+#pragma once
 #include <ranges>
 #include <concepts>
 #include <array>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include <functional>
 
 namespace util {
 
@@ -24,4 +31,74 @@ constexpr auto char_array(typeholder<T, Rest...>, const std::pair<std::size_t, T
     return sparse_array<T, 256>(init_values);
 }
 
+// transparent, lookups by std::string_view or const char* build no std::string
+struct string_hash {
+    using is_transparent = void;
+
+    auto operator()(std::string_view sv) const {
+        return std::hash<std::string_view>{}(sv);
+    }
+};
+
+/*
+Bump allocator, objects are carved out of large blocks and never freed one by one.
+reset() rewinds to the first block in O(1) and keeps every block for reuse,
+so after warm-up a line's AST costs no heap allocation at all.
+Destructors are NOT run, only put here what owns nothing.
+*/
+class Arena {
+    public :
+    explicit Arena(std::size_t block_size = 16 * 1024) : block_size(block_size) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t align) {
+        while(this->curr < this->blocks.size()) {
+            auto& blk = this->blocks[this->curr];
+            std::size_t at = (this->offset + align - 1) & ~(align - 1);
+            if(at + size <= blk.size) {
+                this->offset = at + size;
+                return blk.data.get() + at;
+            }
+            ++this->curr;
+            this->offset = 0;
+        }
+        // blocks come from operator new[], aligned for any fundamental type
+        if(align > alignof(std::max_align_t))
+            throw std::bad_alloc();
+        std::size_t cap = (size > this->block_size) ? size : this->block_size;
+        this->blocks.push_back({std::make_unique<std::byte[]>(cap), cap});
+        ++this->allocations;
+        this->curr = this->blocks.size() - 1;
+        this->offset = size;
+        return this->blocks.back().data.get();
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    void reset() noexcept {
+        this->curr = 0;
+        this->offset = 0;
+    }
+
+    // heap allocations made so far, stops growing once the blocks are warm
+    std::size_t heap_allocations() const noexcept { return allocations; }
+
+    private :
+    struct block {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t size;
+    };
+
+    std::vector<block> blocks;
+    std::size_t block_size;
+    std::size_t curr = 0;
+    std::size_t offset = 0;
+    std::size_t allocations = 0;
+};
+
 }
\ No newline at end of file
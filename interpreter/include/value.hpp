@@ -0,0 +1,326 @@
+#pragma once
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <variant>
+
+/*
+Runtime value, 8 bytes, NaN-boxed.
+
+Any bit pattern that isn't one of ours is a double. Ours are the negative
+quiet NaNs, top 13 bits set, the next 3 bits a tag and a 48-bit payload :
+
+    1 11111111111 1 [tag:3] [payload:48]
+
+doubles that are NaN are stored as the one positive quiet NaN, so a
+computed NaN never reads back as a tagged value.
+
+    NIL     payload 0
+    INT     48-bit two's complement integer, wider int64 go to a pooled IntObject
+    BOOL    0 or 1
+    SSTR    up to 5 bytes inline, length in the top payload byte
+    OBJECT  pointer to a refcounted values::Object (long strings, wide ints, ...)
+
+Type checks are a shift and a compare, no virtual call, no allocation
+unless the payload really doesn't fit.
+*/
+namespace values {
+
+static_assert(std::endian::native == std::endian::little, "Value stores short strings in its low bytes");
+static_assert(sizeof(void*) == 8, "Value packs pointers in 48 bits");
+
+enum class obj_kind : std::uint8_t {
+    STRING,
+    INT
+};
+
+struct Object {
+    std::uint32_t refs = 1;
+    obj_kind kind;
+
+    explicit Object(obj_kind kind) : kind(kind) {}
+};
+
+struct StrObject : Object {
+    std::size_t size;
+
+    const char* data() const noexcept { return reinterpret_cast<const char*>(this + 1); }
+
+    // header and bytes in one allocation
+    static StrObject* make(std::string_view str) {
+        void* mem = ::operator new(sizeof(StrObject) + str.size());
+        auto* obj = new (mem) StrObject(str.size());
+        std::memcpy(const_cast<char*>(obj->data()), str.data(), str.size());
+        return obj;
+    }
+
+    private :
+    explicit StrObject(std::size_t size) : Object(obj_kind::STRING), size(size) {}
+};
+
+/*
+Integers that don't fit in 48 bits. They come from a per-thread free list
+carved out of 64-object slabs, and go back to it when their last Value dies,
+so wide int arithmetic stops allocating once the pool holds as many as are alive at once.
+Slabs are never returned.
+*/
+struct IntObject : Object {
+    union {
+        std::int64_t val;
+        IntObject* next_free; // while it sits in the pool
+    };
+
+    static IntObject* make(std::int64_t val) {
+        IntObject*& free = free_list();
+        if(!free) refill(free);
+        IntObject* obj = free;
+        free = obj->next_free;
+        obj->refs = 1;
+        obj->val = val;
+        return obj;
+    }
+
+    static void recycle(IntObject* obj) noexcept {
+        IntObject*& free = free_list();
+        obj->next_free = free;
+        free = obj;
+    }
+
+    private :
+    static constexpr std::size_t slab_size = 64;
+
+    IntObject() : Object(obj_kind::INT), next_free(nullptr) {}
+
+    static IntObject*& free_list() noexcept {
+        thread_local IntObject* free = nullptr;
+        return free;
+    }
+
+    static void refill(IntObject*& free) {
+        auto* slab = static_cast<IntObject*>(::operator new(slab_size * sizeof(IntObject)));
+        for(std::size_t i = 0; i < slab_size; ++i) {
+            auto* obj = new (slab + i) IntObject();
+            obj->next_free = free;
+            free = obj;
+        }
+    }
+};
+
+class Value {
+    public :
+
+    enum class type : std::uint8_t {
+        NIL,
+        DOUBLE,
+        INT,
+        BOOL,
+        STRING
+    };
+
+    static constexpr int max_sstr = 5;
+    static constexpr std::int64_t max_small = (std::int64_t(1) << 47) - 1;
+    static constexpr std::int64_t min_small = -(std::int64_t(1) << 47);
+
+    Value() noexcept : bits(boxed(NIL, 0)) {}
+    Value(std::monostate) noexcept : Value() {}
+
+    Value(bool val) noexcept : bits(boxed(BOOL, val)) {}
+
+    Value(int val) noexcept : bits(boxed(INT, std::uint64_t(std::int64_t(val)) & payload_mask)) {}
+
+    Value(std::int64_t val) {
+        if(val >= min_small && val <= max_small)
+            this->bits = boxed(INT, std::uint64_t(val) & payload_mask);
+        else
+            this->bits = boxed_obj(object_ptr(IntObject::make(val)));
+    }
+
+    Value(double val) noexcept : bits(std::isnan(val) ? canonical_nan : std::bit_cast<std::uint64_t>(val)) {}
+
+    Value(std::string_view str) {
+        if(str.size() <= max_sstr) {
+            std::uint64_t payload = std::uint64_t(str.size()) << 40;
+            std::memcpy(&payload, str.data(), str.size());
+            this->bits = boxed(SSTR, payload);
+        } else {
+            this->bits = boxed_obj(object_ptr(StrObject::make(str)));
+        }
+    }
+
+    Value(const char* str) : Value(std::string_view(str)) {}
+
+    Value(const Value& other) noexcept : bits(other.bits) {
+        if(auto* obj = object()) ++obj->refs;
+    }
+
+    Value(Value&& other) noexcept : bits(other.bits) {
+        other.bits = boxed(NIL, 0);
+    }
+
+    Value& operator=(const Value& other) noexcept {
+        if(auto* obj = other.object()) ++obj->refs;
+        release();
+        this->bits = other.bits;
+        return *this;
+    }
+
+    Value& operator=(Value&& other) noexcept {
+        if(this != &other) {
+            release();
+            this->bits = other.bits;
+            other.bits = boxed(NIL, 0);
+        }
+        return *this;
+    }
+
+    ~Value() { release(); }
+
+    type get_type() const noexcept {
+        if(is_double()) return type::DOUBLE;
+        switch(tag()) {
+            case INT : return type::INT;
+            case BOOL : return type::BOOL;
+            case SSTR : return type::STRING;
+            case OBJECT :
+                return (object()->kind == obj_kind::INT) ? type::INT : type::STRING;
+            default : return type::NIL;
+        }
+    }
+
+    bool is_double() const noexcept { return (this->bits & tag_prefix) != tag_prefix; }
+    bool is_nil() const noexcept { return this->bits == boxed(NIL, 0); }
+    bool is_bool() const noexcept { return (this->bits >> 48) == head(BOOL); }
+    // the 48-bit case, what arithmetic fast paths test for
+    bool is_small_int() const noexcept { return (this->bits >> 48) == head(INT); }
+    bool is_int() const noexcept { return is_small_int() || is_obj(obj_kind::INT); }
+    bool is_string() const noexcept { return ((this->bits >> 48) == head(SSTR)) || is_obj(obj_kind::STRING); }
+
+    /*
+    Unchecked accessors, test the type first.
+    as_string() of a short string points into this Value.
+    */
+    double as_double() const noexcept { return std::bit_cast<double>(this->bits); }
+    bool as_bool() const noexcept { return this->bits & 1; }
+
+    std::int64_t as_small_int() const noexcept {
+        // sign-extend the 48-bit payload
+        return std::int64_t(this->bits << 16) >> 16;
+    }
+
+    std::int64_t as_int() const noexcept {
+        if(is_small_int()) return as_small_int();
+        return static_cast<const IntObject*>(object())->val;
+    }
+
+    std::string_view as_string() const noexcept {
+        if((this->bits >> 48) == head(SSTR))
+            return std::string_view(reinterpret_cast<const char*>(&this->bits), (this->bits >> 40) & 0xFF);
+        auto* str = static_cast<const StrObject*>(object());
+        return std::string_view(str->data(), str->size);
+    }
+
+    std::uint64_t raw() const noexcept { return bits; }
+
+    /*
+    A small int's payload in the top 48 bits of an int64, the low 16 bits zero.
+    Adding or subtracting two of them overflows exactly when the 48-bit result would,
+    so the arithmetic fast path needs no sign extension and no separate range check.
+    */
+    std::int64_t small_int_high() const noexcept { return std::int64_t(this->bits << 16); }
+
+    // overwrites this Value with the int small_int_high() gave, or a sum of two of them
+    void set_small_int_high(std::int64_t high) noexcept {
+        release();
+        this->bits = boxed(INT, std::uint64_t(high) >> 16);
+    }
+
+    private :
+    enum tag_t : std::uint64_t {
+        NIL,
+        INT,
+        BOOL,
+        SSTR,
+        OBJECT
+    };
+
+    static constexpr std::uint64_t tag_prefix = 0xFFF8'0000'0000'0000;
+    static constexpr std::uint64_t payload_mask = 0x0000'FFFF'FFFF'FFFF;
+    static constexpr std::uint64_t canonical_nan = 0x7FF8'0000'0000'0000;
+
+    static constexpr std::uint64_t boxed(tag_t tag, std::uint64_t payload) noexcept {
+        return tag_prefix | (std::uint64_t(tag) << 48) | payload;
+    }
+    // the top 16 bits of a tagged value
+    static constexpr std::uint64_t head(tag_t tag) noexcept { return boxed(tag, 0) >> 48; }
+
+    // an object nothing points to anymore, back to the int pool or to operator delete
+    static void destroy(Object* obj) noexcept {
+        if(obj->kind == obj_kind::STRING) {
+            static_cast<StrObject*>(obj)->~StrObject();
+            ::operator delete(obj);
+        } else {
+            IntObject::recycle(static_cast<IntObject*>(obj));
+        }
+    }
+
+    struct object_deleter {
+        void operator()(Object* obj) const noexcept { destroy(obj); }
+    };
+    using object_ptr = std::unique_ptr<Object, object_deleter>;
+
+    // obj is only let go once it is boxed, an address past 48 bits destroys it
+    static std::uint64_t boxed_obj(object_ptr obj) {
+        auto addr = reinterpret_cast<std::uintptr_t>(obj.get());
+        if(addr & ~payload_mask)
+            throw std::bad_alloc();
+        obj.release();
+        return boxed(OBJECT, addr);
+    }
+
+    tag_t tag() const noexcept { return static_cast<tag_t>((this->bits >> 48) & 0x7); }
+
+    Object* object() const noexcept {
+        if((this->bits >> 48) != head(OBJECT)) return nullptr;
+        return reinterpret_cast<Object*>(this->bits & payload_mask);
+    }
+
+    bool is_obj(obj_kind kind) const noexcept {
+        auto* obj = object();
+        return obj && obj->kind == kind;
+    }
+
+    void release() noexcept {
+        auto* obj = object();
+        if(!obj || --obj->refs) return;
+        destroy(obj);
+    }
+
+    std::uint64_t bits;
+};
+
+static_assert(sizeof(Value) == 8);
+
+inline std::string to_string(const Value& val) {
+    switch(val.get_type()) {
+        case Value::type::DOUBLE : {
+            char buf[32];
+            auto res = std::to_chars(buf, buf + sizeof(buf), val.as_double());
+            std::string str(buf, res.ptr);
+            // keep 2.0 apart from 2
+            if(str.find_first_of(".eEn") == std::string::npos) str += ".0";
+            return str;
+        }
+        case Value::type::INT : return std::to_string(val.as_int());
+        case Value::type::BOOL : return val.as_bool() ? "true" : "false";
+        case Value::type::STRING : return std::string(val.as_string());
+        default : return "nil";
+    }
+}
+
+}
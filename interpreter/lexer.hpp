@@ -1,11 +1,21 @@
 #pragma once
 #include "basics.hpp"
+#include "scanner.hpp"
 #include <expected>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace lexer {
 
@@ -21,11 +31,21 @@ void read_file(const stdfs::path& path, std::string& buf) {
     stream.read(buf.data(), file_size);
 }
 
+/*
+PROMPT = interactive, one std::getline per line
+FILE   = std::getline over an ifstream
+MAPPED = the whole script is mmap'ed (or slurped when it can't be),
+         lines are handed out as views into it, no copy and no stream per line
+BATCH  = stdin that isn't a terminal, read(2) in large blocks and split in place,
+         no prompt and no iostream sync. PROMPT turns into BATCH by itself
+*/
 class Feed {
     public :
     enum readsrc {
         PROMPT = 1,
-        FILE
+        FILE,
+        MAPPED,
+        BATCH
     };
 
     Feed(readsrc read_source, const stdfs::path& path = "") : read_source(read_source) {
@@ -39,10 +59,23 @@ class Feed {
                 );
             return;
         }
+        if(read_source == MAPPED) {
+            map_file(path);
+            return;
+        }
+        if(read_source == PROMPT && !isatty(STDIN_FILENO))
+            this->read_source = BATCH;
+        if(this->read_source == BATCH) {
+            this->batch_buf.resize(batch_block);
+            return;
+        }
         if(read_source != PROMPT)
             throw std::invalid_argument("Feed(ctor) : Invalid read_source argument");
     }
 
+    Feed(const Feed&) = delete;
+    Feed& operator=(const Feed&) = delete;
+
     bool line_get(std::string& buffer) {
         switch (this->read_source)
         {
@@ -55,12 +88,40 @@ class Feed {
             std::getline(this->stream, buffer);
             return !stream.fail();
 
+        case MAPPED :
+        case BATCH : {
+            std::string_view view;
+            if(!line_get(view)) return false;
+            buffer.assign(view);
+            return true;
+        }
+
         default :
             throw std::runtime_error("Feed.get() : read_source (member) is unknown");
         }
         return false;
     }
 
+    /*
+    The view stays valid until the next line_get() call,
+    for MAPPED it stays valid for the whole life of the Feed.
+    */
+    bool line_get(std::string_view& view) {
+        if(this->read_source == BATCH) return batch_line(view);
+        if(this->read_source != MAPPED) {
+            if(!line_get(this->line_buf)) return false;
+            view = this->line_buf;
+            return true;
+        }
+
+        if(this->pos >= this->content.size()) return false;
+        auto rest = this->content.substr(this->pos);
+        auto nl = rest.find('\n');
+        view = rest.substr(0, nl);
+        this->pos += (nl == rest.npos) ? rest.size() : nl + 1;
+        return true;
+    }
+
     std::optional<std::string> line_get() {
         std::string line;
         if(!line_get(line)) return std::nullopt;
@@ -68,143 +129,324 @@ class Feed {
     }
 
     bool eof() {
+        if(this->read_source == MAPPED) return this->pos >= this->content.size();
+        if(this->read_source == BATCH) return this->batch_eof && this->batch_head >= this->batch_tail;
         return stream.eof();
     }
 
+    // the whole mapped script, empty for other sources
+    std::string_view source() const noexcept { return content; }
+
     ~Feed() {
         stream.close();
+        if(this->map_base != MAP_FAILED)
+            munmap(this->map_base, this->content.size());
     }
 
     private :
     readsrc read_source;
     std::ifstream stream;
-};
+    std::string line_buf;
 
-constexpr auto chrtag_table =
-    util::char_array(util::typeholder<ttag>{}, {
-        {'+', ttag::PLUS},
-        {'-', ttag::MINUS}
-    });
-
-struct token_match_result {
-    bool status = false;
-    const char* ptr = nullptr;
-    token_match_result(bool v, const char* ptr = nullptr) : status(v), ptr(ptr) {}
-    token_match_result(const char* ptr) :  ptr(ptr), status(true) {}
-};
+    void* map_base = MAP_FAILED;
+    std::string slurped;
+    std::string_view content;
+    std::size_t pos = 0;
 
-token_match_result token_1char(basics::Token& buf, const char* it) {
-    if((buf.tag = chrtag_table[static_cast<unsigned char>(*it)]) == ttag::SENT) return false;
-    buf.value = std::string_view(it, 1);
-    return token_match_result{true, ++it};
-}
+    static constexpr std::size_t batch_block = 64 * 1024;
+    std::vector<char> batch_buf;
+    std::size_t batch_head = 0; // first byte not handed out yet
+    std::size_t batch_tail = 0; // end of the bytes read so far
+    bool batch_eof = false;
 
-token_match_result token_number(basics::Token& buf, const char* begin, const char* end) {
-    const char* it = begin;
+    bool batch_line(std::string_view& view) {
+        std::size_t scanned = this->batch_head;
+        while(true) {
+            auto first = this->batch_buf.data() + scanned;
+            auto nl = static_cast<const char*>(std::memchr(first, '\n', this->batch_tail - scanned));
+            if(nl) {
+                view = std::string_view(this->batch_buf.data() + this->batch_head, nl);
+                this->batch_head = nl - this->batch_buf.data() + 1;
+                return true;
+            }
+            if(this->batch_eof) {
+                if(this->batch_head >= this->batch_tail) return false;
+                view = std::string_view(this->batch_buf.data() + this->batch_head, this->batch_buf.data() + this->batch_tail);
+                this->batch_head = this->batch_tail;
+                return true;
+            }
 
-    bool has_comma = false;
-    bool has_e = false;
-    bool has_digit = false;
-    bool has_pm = false;
-    unsigned char c;
+            // keep the partial line, drop what was handed out, grow only when a line outgrows the buffer
+            std::size_t pending = this->batch_tail - this->batch_head;
+            if(this->batch_head > 0)
+                std::memmove(this->batch_buf.data(), this->batch_buf.data() + this->batch_head, pending);
+            this->batch_head = 0;
+            this->batch_tail = pending;
+            scanned = pending;
+            if(this->batch_buf.size() - pending < batch_block / 2)
+                this->batch_buf.resize(this->batch_buf.size() * 2);
 
-    while(it < end) {
-        c = *it;
-        if(std::isdigit(c)) {
-            has_digit = true;
-            ++it;
-            continue;
+            ssize_t n;
+            while((n = read(STDIN_FILENO, this->batch_buf.data() + pending, this->batch_buf.size() - pending)) == -1 && errno == EINTR);
+            if(n == -1)
+                throw std::system_error(
+                    std::error_code(errno, std::system_category()),
+                    ", Feed.line_get() : read failed on stdin"
+                );
+            if(n == 0) this->batch_eof = true;
+            this->batch_tail += n;
         }
+    }
 
-        switch (c)
-        {
-        case '-' :
-        case '+' :
-            if(has_digit || has_pm) {
-                end = it;
-                continue;
-            }
-            has_pm = true;
-            break;
+    void map_file(const stdfs::path& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+            throw std::system_error(
+                std::error_code(errno, std::system_category()),
+                ", Feed(ctor) : failed to open path of -> " + path.string()
+            );
 
-        case '.' :
-            if(has_e || has_comma || !has_digit) {
-                end = it;
-                continue;
+        struct stat st{};
+        bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if(regular && st.st_size > 0) {
+            this->map_base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            if(this->map_base != MAP_FAILED) {
+                madvise(this->map_base, st.st_size, MADV_SEQUENTIAL);
+                this->content = std::string_view(static_cast<const char*>(this->map_base), st.st_size);
             }
-            has_comma = true;
-            break;
-        
-        case 'E' :
-        case 'e' :
-            if(has_e || !has_digit) {
-                end = it;
-                continue;;
-            }
-            has_e = true;
-            has_digit = false;
-            has_pm = false;
-            
-            break;
-        
-        default: 
-            end = it;
+        }
+        close(fd);
+        if(this->map_base != MAP_FAILED || (regular && st.st_size == 0)) return;
+
+        // pipes, procfs and friends can't be mapped
+        std::ifstream in(path, std::ios::binary);
+        in.exceptions(std::ios::badbit);
+        this->slurped.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        this->content = this->slurped;
+    }
+};
+
+constexpr auto token_dfa = util::make_dfa<basics::token_patterns>();
+using dfa_type = std::remove_const_t<decltype(token_dfa)>;
+
+/*
+Tokens that are always exactly one byte long : the byte leads from the
+start state straight into an accepting state with no way out.
+Runs of them skip the DFA walk, see scan::skip_ops().
+*/
+constexpr auto chrtag_table = [] {
+    std::array<ttag, 256> res{};
+    for(std::size_t c = 0; c < 256; c++) {
+        auto s = token_dfa.next[dfa_type::start][c];
+        if(s == dfa_type::dead || token_dfa.accept[s] == ttag::SENT) continue;
+
+        bool terminal = true;
+        for(auto to : token_dfa.next[s]) terminal = terminal && (to == dfa_type::dead);
+        if(terminal) res[c] = token_dfa.accept[s];
+    }
+    return res;
+}();
+
+// every byte chrtag_table maps to a token, what scan::skip_ops() looks for
+constexpr auto op_chars = [] {
+    constexpr std::size_t count = [] {
+        std::size_t n = 0;
+        for(auto tag : chrtag_table) n += (tag != ttag::SENT);
+        return n;
+    }();
+    std::array<unsigned char, count> res{};
+    std::size_t i = 0;
+    for(std::size_t c = 0; c < chrtag_table.size(); c++)
+        if(chrtag_table[c] != ttag::SENT) res[i++] = static_cast<unsigned char>(c);
+    return res;
+}();
+
+// bytes that start an identifier, none of them may directly follow a number
+constexpr auto word_start = [] {
+    std::array<bool, 256> res{};
+    for(std::size_t c = 0; c < 256; c++) {
+        auto s = token_dfa.next[dfa_type::start][c];
+        res[c] = (s != dfa_type::dead && token_dfa.accept[s] == ttag::IDENTIFIER);
+    }
+    return res;
+}();
+
+/*
+Longest match through token_dfa starting at it, one table lookup per byte.
+Digit runs in states that loop on digits are crossed with scan::skip_digits().
+Returns it when nothing matches.
+*/
+inline const char* match_token(ttag& tag, const char* it, const char* end) noexcept {
+    const char* p = it;
+    const char* last = it;
+    auto state = dfa_type::start;
+    while(true) {
+        if(token_dfa.digit_loop[state]) p = scan::skip_digits(p, end);
+        if(token_dfa.accept[state] != ttag::SENT) {
+            tag = token_dfa.accept[state];
+            last = p;
+        }
+        if(p == end) break;
+
+        auto next = token_dfa.next[state][static_cast<unsigned char>(*p)];
+        if(next == dfa_type::dead) break;
+        state = next;
+        ++p;
+    }
+    return last;
+}
+
+/*
+Calls emit(tag, first, last) for every token of [begin, end).
+Returns end on success, otherwise the position no token matched at.
+A number runs straight into an identifier only when it is malformed,
+`1e`, `1e+` and `1ex` stop at the 'e' instead of lexing as `1` and `e...`.
+*/
+template <typename Emit>
+const char* lex_span(const char* begin, const char* end, Emit&& emit) {
+    auto it = begin;
+    ttag tag = ttag::SENT;
+    while(it < end) {
+        it = scan::skip_space(it, end);
+        if(it == end) break;
+
+        // a run of single-char operators goes out in one go
+        if(auto ops_end = scan::skip_ops(it, end, op_chars); ops_end != it) {
+            for(; it < ops_end; ++it)
+                emit(chrtag_table[static_cast<unsigned char>(*it)], it, it + 1);
             continue;
         }
-        ++it;
+        auto last = match_token(tag, it, end);
+        if(last == it) return it;
+        if(tag == ttag::INTEGER && last < end && word_start[static_cast<unsigned char>(*last)]) return last;
+        emit(tag, it, last);
+        it = last;
     }
-    if(!has_digit) return false;
+    return end;
+}
 
-    buf.tag = ttag::INTEGER;
-    buf.value = std::string_view(begin, it);
-    return it;
+// identifiers get their symbol as they are emitted, into symbols::global()
+inline symbols::sym_t intern(ttag tag, std::string_view value) {
+    return (tag == ttag::IDENTIFIER) ? symbols::global().intern(value) : symbols::none;
 }
 
 class Lexer {
     public :
     Lexer() = default;
 
-    bool analyze(Feed& feeder) {
-        this->line.clear(); 
+    /*
+    tokens point into the feeder's line, see Feed::line_get(std::string_view&)
+    false at the end of input, a LEX_INVALID Error on a byte no pattern matches,
+    the line is consumed either way, the next call moves on.
+    */
+    std::expected<bool, basics::Error> analyze(Feed& feeder) {
         this->tokens.clear();
         if(!feeder.line_get(this->line)) return false;
         ++this->line_count;
-        const auto begin = &*this->line.cbegin();
-        const auto end = &*this->line.cend();
-        auto it = begin;
-        basics::Token buf;
-
-        auto insert = [&it, &buf, this](const token_match_result& result) -> bool {
-            if(!result.status)
-                return false;
-            
-            this->tokens.push_back(buf);
-            it = result.ptr;
-            return true;
-        };
+        const auto begin = this->line.data();
+        const auto end = begin + this->line.size();
 
-        while(it < end) {
-            if(std::isspace(*it)) { ++it; continue; }
-
-            if(insert(token_1char(buf, it))) continue;
-            if(insert(token_number(buf, it, end))) continue;
-            
-            throw std::runtime_error(
-                "Lexer error at line "
-                + std::to_string(this->line_count)
-                + ", column "
-                + std::to_string(it - begin)
-            );
-        }
+        auto stop = lex_span(begin, end, [this](ttag tag, const char* first, const char* last) {
+            std::string_view value(first, last);
+            this->tokens.push_back({tag, value, intern(tag, value)});
+        });
+        if(stop != end)
+            return std::unexpected(basics::Error{
+                basics::err_code::LEX_INVALID, basics::token_tag::SENT,
+                static_cast<std::uint32_t>(this->line_count),
+                {static_cast<std::uint32_t>(stop - begin), 1}
+            });
         return true;
     }
 
     const auto& get_tokens() const noexcept { return tokens; }
+    std::string_view get_line() const noexcept { return line; }
+    std::size_t get_line_count() const noexcept { return line_count; }
 
     private :
     std::size_t line_count = 0;
-    std::string line;
+    std::string_view line;
     std::vector<basics::Token> tokens;
 };
 
+/*
+Every token of a whole source buffer, struct-of-arrays :
+1 byte of tag, a 32-bit offset and length into the source and a 32-bit symbol,
+13 bytes a token instead of a 32-byte basics::Token, and views that stay valid as long as
+the source does (e.g. a MAPPED Feed), so a parser can look across lines.
+*/
+class TokenStream {
+    public :
+    TokenStream() = default;
+
+    /*
+    Lexes src line by line, a LEX_INVALID Error on a byte no token matches,
+    the same one Lexer::analyze() gives for that line. Lines before it stay lexed.
+    */
+    std::expected<void, basics::Error> lex(std::string_view src) {
+        if(src.size() > UINT32_MAX)
+            throw std::length_error("TokenStream.lex() : source is larger than 4 GiB");
+        this->source = src;
+        this->tags.clear();
+        this->offsets.clear();
+        this->lengths.clear();
+        this->syms.clear();
+        this->line_firsts.clear();
+
+        const char* base = src.data();
+        const char* end = base + src.size();
+        auto emit = [this, base](ttag tag, const char* first, const char* last) {
+            this->tags.push_back(tag);
+            this->offsets.push_back(static_cast<std::uint32_t>(first - base));
+            this->lengths.push_back(static_cast<std::uint32_t>(last - first));
+            this->syms.push_back(intern(tag, std::string_view(first, last)));
+        };
+
+        for(const char* it = base; it < end;) {
+            auto nl = static_cast<const char*>(std::memchr(it, '\n', end - it));
+            const char* line_end = nl ? nl : end;
+            this->line_firsts.push_back(static_cast<std::uint32_t>(this->tags.size()));
+
+            auto stop = lex_span(it, line_end, emit);
+            if(stop != line_end)
+                return std::unexpected(basics::Error{
+                    basics::err_code::LEX_INVALID, basics::token_tag::SENT,
+                    static_cast<std::uint32_t>(this->line_firsts.size()),
+                    {static_cast<std::uint32_t>(stop - it), 1}
+                });
+            it = nl ? nl + 1 : end;
+        }
+        return {};
+    }
+
+    std::size_t size() const noexcept { return tags.size(); }
+    std::size_t lines() const noexcept { return line_firsts.size(); }
+
+    ttag tag(std::size_t i) const noexcept { return tags[i]; }
+    std::string_view value(std::size_t i) const noexcept { return source.substr(offsets[i], lengths[i]); }
+    symbols::sym_t sym(std::size_t i) const noexcept { return syms[i]; }
+    basics::Token operator[](std::size_t i) const noexcept { return {tags[i], value(i), syms[i]}; }
+
+    // tokens of line n (0 based) are [line_first(n), line_first(n + 1))
+    std::size_t line_first(std::size_t n) const noexcept {
+        return (n < line_firsts.size()) ? line_firsts[n] : tags.size();
+    }
+
+    // 0 based line of token i
+    std::size_t line_of(std::size_t i) const noexcept {
+        auto it = std::upper_bound(line_firsts.begin(), line_firsts.end(), static_cast<std::uint32_t>(i));
+        return (it - line_firsts.begin()) - 1;
+    }
+
+    std::string_view get_source() const noexcept { return source; }
+
+    private :
+    std::string_view source;
+    std::vector<ttag> tags;
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> lengths;
+    std::vector<symbols::sym_t> syms;
+    std::vector<std::uint32_t> line_firsts; // index of the first token of every line
+};
+
 };
\ No newline at end of file
@@ -0,0 +1,504 @@
+#pragma once
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "fold.hpp"
+#include "bytecode.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+A whole script lexed, parsed, folded and lowered to bytecode once, line by line,
+and cached on disk like a .pyc :
+
+    $XDG_CACHE_HOME/shelly/<key>.shc    ($HOME/.cache when XDG_CACHE_HOME is unset)
+
+key is the low half of a 128-bit FNV-1a over format_version and the source,
+the source is hashed once per prepare(). The file repeats the whole hash and the
+source size, a hit must match all of it, so a key collision can't run another
+script's bytecode. The body carries a checksum, a cache that is stale, truncated
+or fails any check is ignored and rewritten, the script itself is always the source of truth.
+
+The tables are the same records in memory and on disk :
+
+    header | line_record[lines] | instr_record[instrs] | span[instrs] | const_record[consts]
+
+every record is a multiple of 8 bytes, so each table stays aligned.
+A hit maps the file, a miss keeps the tables it compiled and writes them with one writev().
+*/
+namespace script {
+
+namespace stdfs = std::filesystem;
+
+// bump on any change to the layout below, to bytecode::opcode, basics::err_code or basics::token_tag
+constexpr std::uint32_t format_version = 5;
+
+constexpr std::uint64_t fnv_basis = 0xcbf29ce484222325;
+constexpr std::uint64_t fnv_prime = 0x100000001b3;
+
+// FNV-1a over 64-bit words, for the cache body whose tables are all multiples of 8 bytes
+inline std::uint64_t checksum(const void* data, std::size_t size, std::uint64_t hash = fnv_basis) {
+    auto* it = static_cast<const unsigned char*>(data);
+    for(std::size_t i = 0; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, it + i, sizeof(word));
+        hash ^= word;
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+// what a cache file must have been compiled from
+struct source_id {
+    std::uint64_t key; // names the file
+    std::uint64_t check; // the other half of the hash
+    std::uint64_t size;
+};
+
+// FNV-1a 128 over format_version and src, times the prime 2^88 + 0x13b is a shift and a small multiply
+inline source_id identify(std::string_view src) {
+    unsigned __int128 hash = (static_cast<unsigned __int128>(0x6c62272e07bb0142) << 64) | 0x62b821756295c58d;
+    auto step = [&hash](const void* data, std::size_t size) {
+        auto* it = static_cast<const unsigned char*>(data);
+        for(std::size_t i = 0; i < size; ++i) {
+            hash ^= it[i];
+            hash = (hash << 88) + hash * 0x13b;
+        }
+    };
+    step(&format_version, sizeof(format_version));
+    step(src.data(), src.size());
+    return {static_cast<std::uint64_t>(hash), static_cast<std::uint64_t>(hash >> 64), src.size()};
+}
+
+// empty when there is nowhere to cache
+inline stdfs::path path_for(std::uint64_t key) {
+    stdfs::path dir;
+    if(const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        dir = xdg;
+    else if(const char* home = std::getenv("HOME"); home && *home)
+        dir = stdfs::path(home) / ".cache";
+    else
+        return {};
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.shc", static_cast<unsigned long long>(key));
+    return dir / "shelly" / name;
+}
+
+struct file_header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t key;
+    std::uint64_t source_check;
+    std::uint64_t source_size;
+    std::uint64_t checksum; // checksum() of everything after the header
+    std::uint32_t lines;
+    std::uint32_t instrs;
+    std::uint32_t consts;
+    std::uint32_t reserved;
+};
+
+// one per source line, err_code NONE and no instructions is an empty line
+struct line_record {
+    std::uint32_t offset;
+    std::uint32_t length;
+    std::uint32_t first_instr;
+    std::uint32_t instr_count;
+    std::uint32_t first_const;
+    std::uint32_t const_count;
+    std::uint32_t depth;
+    std::uint8_t err_code;
+    std::uint8_t err_tag;
+    std::uint16_t reserved;
+    std::uint32_t err_line;
+    std::uint32_t err_first;
+    std::uint32_t err_length;
+    std::uint32_t reserved2;
+};
+
+struct instr_record {
+    std::uint8_t op;
+    std::uint8_t reserved[3];
+    std::uint32_t operand;
+};
+
+struct const_record {
+    std::uint64_t is_double;
+    std::uint64_t bits; // int64 or the double's bits
+};
+
+static_assert(sizeof(file_header) % 8 == 0 && sizeof(line_record) % 8 == 0);
+static_assert(sizeof(instr_record) == 8 && sizeof(basics::span) == 8 && sizeof(const_record) == 16);
+
+constexpr char magic[4] = {'S', 'H', 'C', '\0'};
+
+class Script {
+    public :
+    Script() = default;
+
+    Script(const Script&) = delete;
+    Script& operator=(const Script&) = delete;
+
+    Script(Script&& other) noexcept { *this = std::move(other); }
+
+    Script& operator=(Script&& other) noexcept {
+        if(this != &other) {
+            unmap();
+            // a vector's buffer moves with it, so the table pointers stay valid
+            this->own_lines = std::move(other.own_lines);
+            this->own_instrs = std::move(other.own_instrs);
+            this->own_spans = std::move(other.own_spans);
+            this->own_consts = std::move(other.own_consts);
+            this->head = other.head;
+            this->line_tab = std::exchange(other.line_tab, nullptr);
+            this->instr_tab = std::exchange(other.instr_tab, nullptr);
+            this->span_tab = std::exchange(other.span_tab, nullptr);
+            this->const_tab = std::exchange(other.const_tab, nullptr);
+            this->map_base = std::exchange(other.map_base, MAP_FAILED);
+            this->map_size = std::exchange(other.map_size, 0);
+        }
+        return *this;
+    }
+
+    ~Script() { unmap(); }
+
+    /*
+    Lexes, parses, folds and lowers every line of a MAPPED feed,
+    errors are kept per line and only surface when that line runs.
+    id is identify(feeder.source()), computed once by the caller.
+    */
+    static Script compile(lexer::Feed& feeder, const source_id& id) {
+        auto src = feeder.source();
+        if(src.size() > UINT32_MAX)
+            throw std::length_error("Script::compile() : source is larger than 4 GiB");
+
+        Script res;
+        auto& lines = res.own_lines;
+        auto& instrs = res.own_instrs;
+        auto& spans = res.own_spans;
+        auto& consts = res.own_consts;
+        lines.reserve(std::count(src.begin(), src.end(), '\n') + 1);
+
+        lexer::Lexer lexer_obj;
+        parser::Parser parser_obj;
+        fold::Folder folder;
+        bytecode::Compiler compiler;
+        bytecode::Chunk chunk;
+        util::Arena arena;
+        while(true) {
+            auto more = lexer_obj.analyze(feeder);
+            if(more && !*more) break;
+
+            auto text = lexer_obj.get_line();
+            line_record rec{};
+            rec.offset = static_cast<std::uint32_t>(text.data() - src.data());
+            rec.length = static_cast<std::uint32_t>(text.size());
+            rec.first_instr = static_cast<std::uint32_t>(instrs.size());
+            rec.first_const = static_cast<std::uint32_t>(consts.size());
+
+            std::optional<basics::Error> err;
+            if(!more) {
+                err = more.error();
+            } else {
+                arena.reset();
+                auto tree = parser_obj.parse(lexer_obj.get_tokens(), arena, text);
+                if(!tree) {
+                    err = tree.error();
+                    err->line = static_cast<std::uint32_t>(lexer_obj.get_line_count());
+                } else if(*tree) {
+                    compiler.compile(folder.run(*tree), chunk);
+                    for(std::size_t i = 0; i < chunk.code.size(); ++i) {
+                        instr_record ins{};
+                        ins.op = static_cast<std::uint8_t>(chunk.code[i].op);
+                        ins.operand = chunk.code[i].operand;
+                        instrs.push_back(ins);
+                        spans.push_back(chunk.spans[i]);
+                    }
+                    for(auto& val : chunk.consts) {
+                        const_record con{};
+                        con.is_double = val.is_double();
+                        con.bits = val.is_double()
+                            ? std::bit_cast<std::uint64_t>(val.as_double())
+                            : static_cast<std::uint64_t>(val.as_int());
+                        consts.push_back(con);
+                    }
+                    rec.instr_count = static_cast<std::uint32_t>(chunk.code.size());
+                    rec.const_count = static_cast<std::uint32_t>(chunk.consts.size());
+                    rec.depth = static_cast<std::uint32_t>(chunk.depth);
+                }
+            }
+            if(err) {
+                rec.err_code = static_cast<std::uint8_t>(err->code);
+                rec.err_tag = static_cast<std::uint8_t>(err->tag);
+                rec.err_line = err->line;
+                rec.err_first = err->at.first;
+                rec.err_length = err->at.length;
+            }
+            lines.push_back(rec);
+        }
+
+        auto& head = res.head;
+        std::memcpy(head.magic, magic, sizeof(magic));
+        head.version = format_version;
+        head.key = id.key;
+        head.source_check = id.check;
+        head.source_size = id.size;
+        head.lines = static_cast<std::uint32_t>(lines.size());
+        head.instrs = static_cast<std::uint32_t>(instrs.size());
+        head.consts = static_cast<std::uint32_t>(consts.size());
+        res.line_tab = lines.data();
+        res.instr_tab = instrs.data();
+        res.span_tab = spans.data();
+        res.const_tab = consts.data();
+        head.checksum = res.body_checksum();
+        return res;
+    }
+
+    /*
+    Maps a cache file and checks it against src, false (and nothing kept)
+    when it is missing, belongs to another source or version, or is corrupt.
+    */
+    bool load(const stdfs::path& path, const source_id& id) {
+        *this = Script();
+        if(path.empty()) return false;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1) return false;
+        struct stat st;
+        if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || static_cast<std::size_t>(st.st_size) < sizeof(file_header)) {
+            close(fd);
+            return false;
+        }
+        void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if(base == MAP_FAILED) return false;
+        this->map_base = base;
+        this->map_size = st.st_size;
+        std::memcpy(&this->head, base, sizeof(file_header));
+        if(!valid(id)) {
+            *this = Script();
+            return false;
+        }
+        return true;
+    }
+
+    // atomic, readers see the old file or the new one, false when it can't be written
+    bool save(const stdfs::path& path) const {
+        if(path.empty() || !this->line_tab) return false;
+        std::error_code ec;
+        stdfs::create_directories(path.parent_path(), ec);
+        if(ec) return false;
+        auto tmp = path;
+        tmp += ".tmp." + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd == -1) return false;
+        // one sized writev() of every table, looping only on a short write
+        iovec parts[] = {
+            {const_cast<file_header*>(&this->head), sizeof(file_header)},
+            {const_cast<line_record*>(this->line_tab), this->head.lines * sizeof(line_record)},
+            {const_cast<instr_record*>(this->instr_tab), this->head.instrs * sizeof(instr_record)},
+            {const_cast<basics::span*>(this->span_tab), this->head.instrs * sizeof(basics::span)},
+            {const_cast<const_record*>(this->const_tab), this->head.consts * sizeof(const_record)}
+        };
+        iovec* part = parts;
+        int left = std::size(parts);
+        bool ok = true;
+        while(left > 0) {
+            ssize_t n = writev(fd, part, left);
+            if(n == -1 && errno == EINTR) continue;
+            if(n <= 0) {
+                ok = false;
+                break;
+            }
+            std::size_t done = n;
+            while(left > 0 && done >= part->iov_len) {
+                done -= part->iov_len;
+                ++part;
+                --left;
+            }
+            if(left > 0) {
+                part->iov_base = static_cast<char*>(part->iov_base) + done;
+                part->iov_len -= done;
+            }
+        }
+        if(close(fd) == -1) ok = false;
+        if(!ok || std::rename(tmp.c_str(), path.c_str()) == -1) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool mapped() const noexcept { return map_base != MAP_FAILED; }
+    std::size_t lines() const noexcept { return header().lines; }
+
+    std::string_view text(std::size_t i, std::string_view src) const noexcept {
+        return src.substr(line(i).offset, line(i).length);
+    }
+
+    // a lexer or parser error of line i, nullopt when it compiled (or is empty)
+    std::optional<basics::Error> error(std::size_t i) const noexcept {
+        auto& rec = line(i);
+        if(rec.err_code == static_cast<std::uint8_t>(basics::err_code::NONE)) return std::nullopt;
+        return basics::Error{
+            static_cast<basics::err_code>(rec.err_code),
+            static_cast<basics::token_tag>(rec.err_tag),
+            rec.err_line,
+            {rec.err_first, rec.err_length}
+        };
+    }
+
+    bool empty(std::size_t i) const noexcept { return line(i).instr_count == 0; }
+
+    // refills chunk with line i's bytecode, reusing its capacity
+    void chunk(std::size_t i, bytecode::Chunk& out) const {
+        auto& rec = line(i);
+        auto* ins = this->instr_tab + rec.first_instr;
+        auto* spn = this->span_tab + rec.first_instr;
+        auto* con = this->const_tab + rec.first_const;
+
+        out.code.clear();
+        out.spans.assign(spn, spn + rec.instr_count);
+        out.consts.clear();
+        for(std::uint32_t n = 0; n < rec.instr_count; ++n)
+            out.code.push_back({static_cast<bytecode::opcode>(ins[n].op), ins[n].operand});
+        for(std::uint32_t n = 0; n < rec.const_count; ++n) {
+            if(con[n].is_double)
+                out.consts.emplace_back(std::bit_cast<double>(con[n].bits));
+            else
+                out.consts.emplace_back(static_cast<std::int64_t>(con[n].bits));
+        }
+        out.depth = rec.depth;
+    }
+
+    private :
+    const file_header& header() const noexcept { return this->head; }
+    const line_record& line(std::size_t i) const noexcept { return this->line_tab[i]; }
+
+    std::uint64_t file_size() const noexcept {
+        return sizeof(file_header)
+            + std::uint64_t(this->head.lines) * sizeof(line_record)
+            + std::uint64_t(this->head.instrs) * (sizeof(instr_record) + sizeof(basics::span))
+            + std::uint64_t(this->head.consts) * sizeof(const_record);
+    }
+
+    // the tables in file order, chained as if they were one buffer
+    std::uint64_t body_checksum() const noexcept {
+        auto hash = checksum(this->line_tab, this->head.lines * sizeof(line_record));
+        hash = checksum(this->instr_tab, this->head.instrs * sizeof(instr_record), hash);
+        hash = checksum(this->span_tab, this->head.instrs * sizeof(basics::span), hash);
+        return checksum(this->const_tab, this->head.consts * sizeof(const_record), hash);
+    }
+
+    /*
+    Everything the VM would otherwise trust : which source it came from, table bounds,
+    opcodes, constant indexes and the stack depth, replayed per line.
+    The source itself isn't read again, id was hashed from it once.
+    */
+    bool valid(const source_id& id) {
+        auto& head = header();
+        if(std::memcmp(head.magic, magic, sizeof(magic)) != 0) return false;
+        if(head.version != format_version || head.key != id.key || head.source_check != id.check || head.source_size != id.size)
+            return false;
+        if(file_size() != this->map_size) return false;
+
+        auto* base = static_cast<const std::byte*>(this->map_base) + sizeof(file_header);
+        this->line_tab = reinterpret_cast<const line_record*>(base);
+        this->instr_tab = reinterpret_cast<const instr_record*>(this->line_tab + head.lines);
+        this->span_tab = reinterpret_cast<const basics::span*>(this->instr_tab + head.instrs);
+        this->const_tab = reinterpret_cast<const const_record*>(this->span_tab + head.instrs);
+        if(head.checksum != body_checksum()) return false;
+
+        for(std::uint32_t i = 0; i < head.lines; ++i) {
+            auto& rec = line(i);
+            if(std::uint64_t(rec.offset) + rec.length > head.source_size) return false;
+            if(std::uint64_t(rec.first_instr) + rec.instr_count > head.instrs) return false;
+            if(std::uint64_t(rec.first_const) + rec.const_count > head.consts) return false;
+            if(rec.instr_count == 0) {
+                if(rec.depth != 0) return false;
+                continue;
+            }
+
+            std::int64_t depth = 0, deepest = 0;
+            for(std::uint32_t n = 0; n < rec.instr_count; ++n) {
+                auto& in = this->instr_tab[rec.first_instr + n];
+                switch(static_cast<bytecode::opcode>(in.op)) {
+                    case bytecode::opcode::PUSH :
+                        if(in.operand >= rec.const_count) return false;
+                        ++depth;
+                        break;
+                    case bytecode::opcode::ADD :
+                    case bytecode::opcode::SUB :
+                        if(depth < 2) return false;
+                        --depth;
+                        break;
+                    case bytecode::opcode::NEG :
+                        if(depth < 1) return false;
+                        break;
+                    case bytecode::opcode::HALT :
+                        if(depth < 1 || n + 1 != rec.instr_count) return false;
+                        break;
+                    default :
+                        return false;
+                }
+                if(depth > deepest) deepest = depth;
+            }
+            if(static_cast<bytecode::opcode>(this->instr_tab[rec.first_instr + rec.instr_count - 1].op) != bytecode::opcode::HALT)
+                return false;
+            // the VM sizes its stack to depth, it must be exactly what the code needs
+            if(deepest != rec.depth) return false;
+        }
+        return true;
+    }
+
+    void unmap() noexcept {
+        if(this->map_base != MAP_FAILED) {
+            munmap(this->map_base, this->map_size);
+            this->map_base = MAP_FAILED;
+            this->map_size = 0;
+        }
+    }
+
+    file_header head{};
+    // into the mapped file on a hit, into the own_ vectors after compile()
+    const line_record* line_tab = nullptr;
+    const instr_record* instr_tab = nullptr;
+    const basics::span* span_tab = nullptr;
+    const const_record* const_tab = nullptr;
+    std::vector<line_record> own_lines;
+    std::vector<instr_record> own_instrs;
+    std::vector<basics::span> own_spans;
+    std::vector<const_record> own_consts;
+    void* map_base = MAP_FAILED;
+    std::size_t map_size = 0;
+};
+
+/*
+The script-run entry point : the cached form of feeder's script,
+compiled and written back when the cache is missing, stale or corrupt.
+feeder must be MAPPED, and only its source() is read when the cache hits.
+*/
+inline Script prepare(lexer::Feed& feeder, bool* hit = nullptr) {
+    auto id = identify(feeder.source());
+    auto path = path_for(id.key);
+    Script res;
+    bool loaded = res.load(path, id);
+    if(hit) *hit = loaded;
+    if(loaded) return res;
+    res = Script::compile(feeder, id);
+    res.save(path);
+    return res;
+}
+
+}
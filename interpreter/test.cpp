@@ -1,15 +1,524 @@
 #include "lexer.hpp"
+#include "parser.hpp"
+#include "evaluator.hpp"
+#include "bytecode.hpp"
+#include "fold.hpp"
+#include "diagnostic.hpp"
+#include "script.hpp"
+#include "scope.hpp"
+#include <algorithm>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+
+/*
+usage : test [--tree | --check] [--fold] [--allocs] [path]
+       test --script path
+       test --script-cache
+       test --tokens path
+       test --scope
+       test --lex
+       test --deep
+default runs the bytecode VM, --tree the tree walking evaluator,
+--check runs both and fails on the first line they disagree on.
+--fold runs fold::Folder first, --check then compares the unfolded tree with the folded VM.
+--allocs prints the heap allocations made lexing, parsing and running each line.
+--script runs path through script::prepare(), from the compiled cache when it is fresh.
+--script-cache runs a script through script::prepare() under a scratch XDG_CACHE_HOME and
+         damages its cache file between runs : truncated, a flipped bit, a line depth
+         raised with a fixed checksum, another script's cache under this one's key.
+         Every damaged cache must miss and recompile, and the output must not change.
+--tokens lexes path whole into a lexer::TokenStream and fails unless it holds exactly
+         what Lexer yields line by line, down to the bytes each value views and the error.
+--scope  checks scope::Scope : parent and child never see each other's writes, an unset
+         hides the parents' value, envp() is cached and shared until an export changes it,
+         and a chain nested past max_depth still resolves once it is flattened.
+--lex    lexes fixed lines through lexer::lex_span() and checks their tokens, or the byte
+         the lexer stops at : a malformed number like `1e` or `1ex` is an error at the 'e'.
+--deep   parses lines far longer than any stack : prefix operators nested past
+         parser::Parser::max_nesting are a TOO_DEEP error, not a crash, and a flat
+         200000 term sum runs on the VM and the tree, then folds down to one literal.
+*/
+enum class engine { VM, TREE, CHECK };
+
+// every operator new in the process, read around a line with --allocs
+static std::size_t allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++allocations;
+    if(void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+// kept out of line, inlined free() into node containers trips -Wmismatched-new-delete
+[[gnu::noinline]] void operator delete(void* ptr) noexcept { std::free(ptr); }
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+static std::string outcome(const std::optional<basics::Error>& err, const basics::valtype& val, const lexer::Lexer& lex) {
+    if(!err) return "Result : " + values::to_string(val);
+    auto shown = *err;
+    shown.line = static_cast<std::uint32_t>(lex.get_line_count());
+    return basics::render(shown, lex.get_line());
+}
+
+static int check_tokens(const char* path) {
+    lexer::Feed feeder(lexer::Feed::MAPPED, path);
+    lexer::TokenStream stream;
+    auto lexed = stream.lex(feeder.source());
+    std::size_t bad_line = lexed ? 0 : lexed.error().line; // 1 based, 0 when everything lexed
 
-int main() {
-    lexer::Feed feeder(lexer::Feed::PROMPT);
     lexer::Lexer lexer_obj;
+    std::size_t line = 0;
+    auto mismatch = [&line](const char* what) {
+        std::cout << "Token mismatch on line " << line << " : " << what << std::endl;
+        return 1;
+    };
     while(true) {
-        auto res = lexer_obj.analyze(feeder);
+        auto more = lexer_obj.analyze(feeder);
+        if(more && !*more) break;
+        ++line;
+        if(!more) {
+            if(line != bad_line) return mismatch("Lexer failed, TokenStream did not");
+            auto& want = more.error();
+            auto& got = lexed.error();
+            if(got.code != want.code || got.tag != want.tag || got.at.first != want.at.first || got.at.length != want.at.length)
+                return mismatch("error");
+            break;
+        }
+        if(line == bad_line) return mismatch("TokenStream failed, Lexer did not");
+
+        auto& toks = lexer_obj.get_tokens();
+        std::size_t first = stream.line_first(line - 1);
+        if(stream.line_first(line) - first != toks.size()) return mismatch("token count");
+        for(std::size_t i = 0; i < toks.size(); ++i) {
+            auto val = stream.value(first + i);
+            if(stream.tag(first + i) != toks[i].tag) return mismatch("tag");
+            if(val.data() != toks[i].value.data() || val.size() != toks[i].value.size()) return mismatch("value");
+            if(stream.sym(first + i) != toks[i].sym) return mismatch("symbol");
+            if(stream.line_of(first + i) != line - 1) return mismatch("line_of");
+        }
+    }
+    if(bad_line > line) return mismatch("TokenStream failed past the last line");
+    if(!bad_line && stream.lines() != line) return mismatch("line count");
+    std::cout << "Tokens : " << stream.size() << " on " << line << " lines match";
+    if(bad_line) std::cout << ", both stop at line " << bad_line;
+    std::cout << std::endl;
+    return 0;
+}
+
+// what --script prints for every line of compiled
+static std::string run_script(const script::Script& compiled, std::string_view src) {
+    std::string res;
+    bytecode::Chunk chunk;
+    bytecode::VM vm;
+    basics::valtype val;
+    for(std::size_t i = 0; i < compiled.lines(); ++i) {
+        auto err = compiled.error(i);
+        if(!err && compiled.empty(i)) continue;
+        if(!err) {
+            compiled.chunk(i, chunk);
+            err = vm.run(chunk, &val);
+        }
+        if(err) {
+            err->line = static_cast<std::uint32_t>(i + 1);
+            res += basics::render(*err, compiled.text(i, src));
+        } else {
+            res += "Result : " + values::to_string(val);
+        }
+        res += '\n';
+    }
+    return res;
+}
+
+static std::vector<char> read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), {});
+}
+
+static void write_file(const std::string& path, const std::vector<char>& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+static int check_script_cache() {
+    char dir[] = "/tmp/shelly-cache-XXXXXX";
+    if(!mkdtemp(dir)) {
+        std::perror("test : mkdtemp() failed");
+        return 2;
+    }
+    setenv("XDG_CACHE_HOME", dir, 1);
+    // same length, so the forged cache below passes the size check
+    std::string path = std::string(dir) + "/a.sh", other_path = std::string(dir) + "/b.sh";
+    write_file(path, {'1', ' ', '+', ' ', '2', '\n', '3', ' ', '-', ' ', '1', '0', '\n', '\n', 'x', '\n'});
+    write_file(other_path, {'1', ' ', '+', ' ', '5', '\n', '3', ' ', '-', ' ', '1', '1', '\n', '\n', 'x', '\n'});
+
+    int failed = 0;
+    auto expect = [&failed](bool cond, const char* what) {
+        if(!cond) {
+            std::cout << "Script cache mismatch : " << what << std::endl;
+            ++failed;
+        }
+    };
+    // prepare() on path, with whether it hit and what it printed
+    auto run = [](const std::string& at, bool& hit) {
+        lexer::Feed feeder(lexer::Feed::MAPPED, at);
+        auto compiled = script::prepare(feeder, &hit);
+        return run_script(compiled, feeder.source());
+    };
+    auto source = read_file(path);
+    auto cache = script::path_for(script::identify(std::string_view(source.data(), source.size())).key).string();
+
+    bool hit = true;
+    auto want = run(path, hit);
+    expect(!hit, "first run misses");
+    expect(want.starts_with("Result : 3\nResult : -7\n") && want.find("at line 4") != std::string::npos, "first run output");
+    expect(run(path, hit) == want && hit, "second run hits with the same output");
+    auto good = read_file(cache);
+
+    auto damaged = [&](std::vector<char> bytes, const char* what) {
+        write_file(cache, bytes);
+        bool hit = true;
+        expect(run(path, hit) == want && !hit, what);
+        expect(read_file(cache) == good, "a miss rewrites the cache");
+    };
+    damaged(std::vector<char>(good.begin(), good.end() - 8), "a truncated cache misses");
+    auto flipped = good;
+    flipped[sizeof(script::file_header) + 4] ^= 1;
+    damaged(flipped, "a flipped bit misses");
+
+    // checksum fixed up, only valid() replaying the stack depth can catch it
+    auto deep = good;
+    auto* head = reinterpret_cast<script::file_header*>(deep.data());
+    auto* first = reinterpret_cast<script::line_record*>(deep.data() + sizeof(script::file_header));
+    first->depth = 1u << 30;
+    head->checksum = script::checksum(deep.data() + sizeof(script::file_header), deep.size() - sizeof(script::file_header));
+    damaged(deep, "a line depth past what its code needs misses");
+
+    // another script's cache under this key, as a hash collision would leave it
+    run(other_path, hit);
+    auto other_source = read_file(other_path);
+    auto forged = read_file(script::path_for(script::identify(std::string_view(other_source.data(), other_source.size())).key).string());
+    reinterpret_cast<script::file_header*>(forged.data())->key = reinterpret_cast<const script::file_header*>(good.data())->key;
+    damaged(forged, "another script's cache under the same key misses");
+
+    std::filesystem::remove_all(dir);
+    if(failed) return 1;
+    std::cout << "Script cache : ok" << std::endl;
+    return 0;
+}
+
+// "unset" when sym has no value in sc
+static std::string scope_value(const scope::Scope& sc, symbols::sym_t sym) {
+    auto* val = sc.get(sym);
+    return val ? values::to_string(*val) : "unset";
+}
+
+static std::vector<std::string> scope_env(const scope::Scope& sc) {
+    std::vector<std::string> res;
+    for(auto it = sc.envp(); *it; ++it) res.emplace_back(*it);
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+static int check_scope() {
+    auto& names = symbols::global();
+    auto a = names.intern("A"), b = names.intern("B"), c = names.intern("C"), x = names.intern("X");
+    int failed = 0;
+    auto expect = [&failed](bool cond, const char* what) {
+        if(!cond) {
+            std::cout << "Scope mismatch : " << what << std::endl;
+            ++failed;
+        }
+    };
+
+    char var_a[] = "A=1", var_b[] = "B=2";
+    char* env[] = {var_a, var_b, nullptr};
+    auto root = scope::Scope::from_environ(env);
+    root.set(c, "local");
+    expect(scope_value(root, a) == "1" && root.is_exported(a), "from_environ exports A=1");
+    expect(scope_value(root, c) == "local" && !root.is_exported(c), "set leaves C unexported");
+
+    // isolation both ways
+    auto kid = root.child();
+    expect(scope_value(kid, a) == "1" && scope_value(kid, c) == "local", "child sees the parent");
+    kid.set(a, "kid");
+    kid.set(x, "kid only");
+    root.set(b, "root");
+    expect(scope_value(root, a) == "1" && scope_value(root, x) == "unset", "parent doesn't see the child's writes");
+    expect(scope_value(kid, b) == "2", "child doesn't see the parent's later writes");
+    expect(kid.is_exported(a), "set keeps A exported in the child");
+
+    // tombstones
+    kid.unset(c);
+    kid.unset(b);
+    expect(scope_value(kid, c) == "unset" && scope_value(kid, b) == "unset", "unset hides the parent's value");
+    expect(scope_value(root, c) == "local" && scope_value(root, b) == "root", "unset in the child leaves the parent alone");
+    auto grandkid = kid.child();
+    expect(scope_value(grandkid, c) == "unset", "a frozen unset still hides the value");
+    grandkid.set(c, "back");
+    expect(scope_value(grandkid, c) == "back" && scope_value(kid, c) == "unset", "set after unset is local");
+
+    // envp cache
+    auto env_scope = scope::Scope::from_environ(env);
+    auto first = env_scope.envp();
+    expect(env_scope.envp() == first, "envp is cached");
+    env_scope.set(x, "not exported");
+    expect(env_scope.envp() == first, "an unexported set keeps the cache");
+    auto env_kid = env_scope.child();
+    expect(env_kid.envp() == first, "child shares the parent's envp");
+    env_kid.set(a, "changed");
+    auto rebuilt = env_kid.envp();
+    expect(rebuilt != first, "an exported set rebuilds envp");
+    expect(env_scope.envp() == first, "the child's rebuild leaves the parent's envp");
+    expect(scope_env(env_kid) == std::vector<std::string>{"A=changed", "B=2"}, "rebuilt envp holds the new value");
+    expect(scope_env(env_scope) == std::vector<std::string>{"A=1", "B=2"}, "parent envp holds the old value");
+    env_kid.mark_exported(x);
+    expect(env_kid.envp() != rebuilt, "export rebuilds envp");
+    env_kid.unset(b);
+    expect(scope_env(env_kid) == std::vector<std::string>{"A=changed", "X=not exported"}, "unset drops an export");
+
+    // well past max_depth, every level writes so every child() freezes a new layer
+    constexpr int depth = 40;
+    std::vector<scope::Scope> chain;
+    chain.reserve(depth + 1);
+    chain.push_back(scope::Scope::from_environ(env));
+    std::vector<symbols::sym_t> level_syms;
+    for(int i = 0; i < depth; ++i) {
+        level_syms.push_back(names.intern("L" + std::to_string(i)));
+        chain.back().set(level_syms.back(), i);
+        if(i == 5) chain.back().unset(b);
+        chain.push_back(chain.back().child());
+    }
+    auto& deepest = chain.back();
+    bool all_seen = true;
+    for(int i = 0; i < depth; ++i)
+        all_seen = all_seen && scope_value(deepest, level_syms[i]) == std::to_string(i);
+    expect(all_seen, "a flattened chain sees every level");
+    expect(scope_value(deepest, a) == "1" && deepest.is_exported(a), "a flattened chain sees the root");
+    expect(scope_value(deepest, b) == "unset", "an unset survives flattening");
+    expect(scope_value(chain[3], b) == "2", "scopes sharing the old chain keep it");
+    expect(scope_value(chain[3], level_syms[10]) == "unset", "scopes sharing the old chain don't see later levels");
+    expect(scope_env(deepest) == std::vector<std::string>{"A=1"}, "a flattened chain builds envp");
+
+    if(failed) return 1;
+    std::cout << "Scope : ok" << std::endl;
+    return 0;
+}
+
+// "TAG(value) ..." for every token of src, "error at N" when the lexer stops at byte N
+static std::string lex_line(std::string_view src) {
+    std::string res;
+    auto stop = lexer::lex_span(src.data(), src.data() + src.size(),
+        [&res](basics::token_tag tag, const char* first, const char* last) {
+            if(!res.empty()) res += ' ';
+            res += basics::get_info(tag).name;
+            res += '(';
+            res.append(first, last);
+            res += ')';
+        });
+    if(stop != src.data() + src.size()) return "error at " + std::to_string(stop - src.data());
+    return res;
+}
+
+static int check_lex() {
+    const std::pair<std::string_view, std::string_view> cases[] = {
+        {"1e", "error at 1"},
+        {"1e+", "error at 1"},
+        {"1ex", "error at 1"},
+        {"2 + 12abc", "error at 6"},
+        {"1.5e", "error at 3"},
+        {"1e5", "INTEGER(1e5)"},
+        {"1.5e-3 + x1", "INTEGER(1.5e-3) PLUS(+) IDENTIFIER(x1)"},
+        {"e1 - 1", "IDENTIFIER(e1) MINUS(-) INTEGER(1)"},
+        {"1 e", "INTEGER(1) IDENTIFIER(e)"}
+    };
+    int failed = 0;
+    for(auto [src, want] : cases) {
+        auto got = lex_line(src);
+        if(got == want) continue;
+        std::cout << "Lex mismatch on \"" << src << "\" : got " << got << ", want " << want << std::endl;
+        ++failed;
+    }
+    if(failed) return 1;
+    std::cout << "Lex : ok" << std::endl;
+    return 0;
+}
+
+// tokens of src as the lexer yields them, parsed into arena
+static std::expected<asts::Expr*, basics::Error> parse_text(std::string_view src, util::Arena& arena) {
+    std::vector<basics::Token> tokens;
+    lexer::lex_span(src.data(), src.data() + src.size(),
+        [&tokens](basics::token_tag tag, const char* first, const char* last) {
+            tokens.push_back({tag, std::string_view(first, last)});
+        });
+    arena.reset();
+    return parser::Parser().parse(tokens, arena, src);
+}
+
+static int check_deep() {
+    int failed = 0;
+    auto expect = [&failed](bool cond, const char* what) {
+        if(cond) return;
+        std::cout << "Deep check failed : " << what << std::endl;
+        ++failed;
+    };
+    util::Arena arena;
+    evaluator::Evaluator ev;
+    basics::valtype val;
+
+    std::string src = std::string(300000, '-') + "1";
+    auto tree = parse_text(src, arena);
+    expect(!tree && tree.error().code == basics::err_code::TOO_DEEP, "300000 nested '-' are a TOO_DEEP error");
+
+    src = std::string(parser::Parser::max_nesting, '-') + "7";
+    tree = parse_text(src, arena);
+    expect(tree && !(*tree)->accept(ev, &val) && values::to_string(val) == "7", "max_nesting nested '-' still run");
+
+    src = "1";
+    for(int i = 0; i < 200000; i++) src += (i % 2) ? " - 1" : " + 2";
+    tree = parse_text(src, arena);
+    expect(tree.has_value(), "a flat 200000 term sum parses");
+    bytecode::Compiler compiler;
+    bytecode::Chunk chunk;
+    bytecode::VM vm;
+    if(tree) {
+        compiler.compile(*tree, chunk);
+        expect(!vm.run(chunk, &val) && values::to_string(val) == "100001", "the VM runs a flat 200000 term sum");
+        expect(!(*tree)->accept(ev, &val) && values::to_string(val) == "100001", "the tree runs a flat 200000 term sum");
+        fold::Folder folder;
+        auto* root = folder.run(*tree);
+        expect(root->kind == asts::expr_kind::INT && static_cast<asts::IntExpr*>(root)->val == 100001,
+            "a flat 200000 term sum folds into one literal");
+    }
+
+    if(failed) return 1;
+    std::cout << "Deep : ok" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    engine mode = engine::VM;
+    bool do_fold = false;
+    bool count_allocs = false;
+    bool as_script = false;
+    bool as_tokens = false;
+    bool as_scope = false;
+    bool as_lex = false;
+    bool as_deep = false;
+    bool as_script_cache = false;
+    const char* path = nullptr;
+    for(int i = 1; i < argc; ++i) {
+        if(std::strcmp(argv[i], "--tree") == 0) mode = engine::TREE;
+        else if(std::strcmp(argv[i], "--check") == 0) mode = engine::CHECK;
+        else if(std::strcmp(argv[i], "--fold") == 0) do_fold = true;
+        else if(std::strcmp(argv[i], "--allocs") == 0) count_allocs = true;
+        else if(std::strcmp(argv[i], "--script") == 0) as_script = true;
+        else if(std::strcmp(argv[i], "--script-cache") == 0) as_script_cache = true;
+        else if(std::strcmp(argv[i], "--tokens") == 0) as_tokens = true;
+        else if(std::strcmp(argv[i], "--scope") == 0) as_scope = true;
+        else if(std::strcmp(argv[i], "--lex") == 0) as_lex = true;
+        else if(std::strcmp(argv[i], "--deep") == 0) as_deep = true;
+        else path = argv[i];
+    }
+
+    if(as_scope) return check_scope();
+    if(as_lex) return check_lex();
+    if(as_deep) return check_deep();
+    if(as_script_cache) return check_script_cache();
+
+    if(as_tokens) {
+        if(!path) {
+            std::cerr << "test : --tokens needs a path" << std::endl;
+            return 2;
+        }
+        return check_tokens(path);
+    }
+
+    if(as_script) {
+        if(!path) {
+            std::cerr << "test : --script needs a path" << std::endl;
+            return 2;
+        }
+        lexer::Feed feeder(lexer::Feed::MAPPED, path);
+        bool hit = false;
+        auto compiled = script::prepare(feeder, &hit);
+        std::cerr << "Cache : " << (hit ? "hit" : "miss") << std::endl;
+        std::cout << run_script(compiled, feeder.source());
+        return 0;
+    }
+
+    lexer::Feed feeder = path
+        ? lexer::Feed(lexer::Feed::MAPPED, path)
+        : lexer::Feed(lexer::Feed::PROMPT);
+    lexer::Lexer lexer_obj;
+    parser::Parser parser_obj;
+    evaluator::Evaluator ev;
+    bytecode::Compiler compiler;
+    bytecode::Chunk chunk;
+    bytecode::VM vm;
+    fold::Folder folder;
+    util::Arena arena;
+    basics::valtype val;
+    while(true) {
+        std::size_t before = allocations;
+        auto more = lexer_obj.analyze(feeder);
+        if(!more) {
+            std::cout << basics::render(more.error(), lexer_obj.get_line()) << std::endl;
+            continue;
+        }
+        if(!*more) break;
+
+        arena.reset();
+        auto tree = parser_obj.parse(lexer_obj.get_tokens(), arena, lexer_obj.get_line());
+        std::size_t used = allocations - before;
+
         std::cout << "Tokens : ";
         for(auto& tok : lexer_obj.get_tokens()) {
-            std::cout << basics::get_info(tok.tag).name << "(\"" << tok.value << "\") ";
+            std::cout << basics::get_info(tok.tag).name << "(\"" << tok.value << "\"";
+            if(tok.sym != symbols::none) std::cout << " #" << tok.sym;
+            std::cout << ") ";
         }
         std::cout << std::endl;
+
+        if(!tree) {
+            auto err = tree.error();
+            err.line = static_cast<std::uint32_t>(lexer_obj.get_line_count());
+            std::cout << basics::render(err, lexer_obj.get_line()) << std::endl;
+            continue;
+        }
+        if(!*tree) continue;
+
+        asts::Expr* root = *tree;
+        std::string res;
+        if(mode == engine::CHECK)
+            res = outcome(root->accept(ev, &val), val, lexer_obj);
+        if(do_fold) {
+            root = folder.run(root);
+            std::cout << "Folded : " << folder.eliminated() << " nodes" << std::endl;
+        }
+
+        std::optional<basics::Error> err;
+        before = allocations;
+        if(mode == engine::TREE) {
+            err = root->accept(ev, &val);
+        } else {
+            compiler.compile(root, chunk);
+            err = vm.run(chunk, &val);
+        }
+        used += allocations - before;
+
+        auto run_res = outcome(err, val, lexer_obj);
+        if(mode == engine::CHECK && run_res != res) {
+            std::cout << "Engine mismatch on line " << lexer_obj.get_line_count() << " : tree \"" << res
+                      << "\", vm \"" << run_res << "\"" << std::endl;
+            return 1;
+        }
+        std::cout << run_res << std::endl;
+        if(count_allocs && !err)
+            std::cout << "Allocations : " << used << std::endl;
     }
-}
\ No newline at end of file
+}
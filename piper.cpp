@@ -6,162 +6,151 @@
 #include <sys/wait.h>
 #include <utility>
 #include <cstring>
+#include <climits>
 #include <system_error>
 #include <iostream>
-
-struct string_hash {
-	using is_transparent = void;
-
-	auto operator()(std::string_view sv) const {
-		return std::hash<std::string_view>{}(sv);
-	}
-};
-
-void sys_err(const char* msg) {
-	throw std::system_error(errno, std::generic_category(), msg);
-}
-
-void sys_err(const std::string& msg) {
-	throw std::system_error(errno, std::generic_category(), msg);
-}
-
-class Piping {
-	private :
-	int pipefd[2]{-1, -1};
-	
-	static void close_fd(int& fd) noexcept {
-		if(fd != -1)
-			close(fd);
-		fd = -1;
-	}
-
-	static void close_fd(const int& fd) noexcept {
-		if(fd != -1)
-			close(fd);
-	}
-
-	public :
-	Piping() noexcept { new_pipe(); }
-
-	Piping(const Piping& _) = delete;
-	Piping& operator=(const Piping& _) = delete;
-
-	Piping(Piping&& oth) noexcept {
-		pipefd[0] = std::exchange(oth.pipefd[0], -1);
-		pipefd[1] = std::exchange(oth.pipefd[1], -1);
-	}
-
-	Piping& operator=(Piping&& oth) noexcept {
-		if(this == &oth) return *this;
-		close_fd(pipefd[0]);
-		close_fd(pipefd[1]);
-		pipefd[0] = std::exchange(oth.pipefd[0], -1);
-		pipefd[1] = std::exchange(oth.pipefd[1], -1);
-		return *this;
-	}
-
-	int read_end() const noexcept { return pipefd[0]; }
-	int write_end() const noexcept { return pipefd[1]; }
-
-	void new_pipe() {
-		close_pipe();
-		if(pipe(pipefd) == -1) {
-			throw std::system_error(
-				errno,
-				std::generic_category(),
-				"Piping : new_pipe() failed"
-			);
-		}
-	}
-
-	static int equalize(int targetfd, int sourcefd) noexcept {
-		return dup2(sourcefd, targetfd);
-	}
-
-	static int duplicate(int targetfd) noexcept {
-		return dup(targetfd);
-	}
-
-	void close_pipe() noexcept {
-		close_fd(pipefd[0]);
-		close_fd(pipefd[1]);
-	}
-
-	void cclose_pipe() const noexcept {
-		close_fd(pipefd[0]);
-		close_fd(pipefd[1]);
-	}
-	
-	~Piping() noexcept {
-		close_pipe();
-	}
-};
+#include <charconv>
+#include <string_view>
+#include <memory>
+#include <chrono>
+#include "piper/piping.hpp"
+#include "piper/spawn.hpp"
+#include "piper/reaper.hpp"
+#include "piper/builtins.hpp"
+#include "piper/pathcache.hpp"
+#include "piper/stats.hpp"
+#include "piper/meter.hpp"
+#include "piper/zygote.hpp"
+#include "piper/cmdline.hpp"
+#include "piper/pipeline.hpp"
+#include "interpreter/include/scope.hpp"
 
 void panic(const char* msg) {
     perror(msg);
     exit(1);
 }
 
-void run_pipe(std::vector<char**>& commands) {
-    int real_stdin = Piping::duplicate(STDIN_FILENO);
-    if(real_stdin == -1) sys_err("run_pipe : duplicate() failed");
-	Piping curr_pipe;
-	curr_pipe.close_pipe();
-	int i = 0;
-	while(i < commands.size()) {
-		std::cerr << "i : " << i << "\n";
-		bool not_end = (i + 1 < commands.size());
-
-		if(not_end) { 
-			curr_pipe.new_pipe();
-		}
-
-		pid_t pid = fork();
-		if(pid == -1) sys_err("fork failed");
-		if(pid == 0) {
-			if(not_end) {
-				Piping::equalize(STDOUT_FILENO, curr_pipe.write_end());
-				curr_pipe.cclose_pipe();
+int main(int argc, char** argv) {
+	pipe_options opts;
+	int left = 1;
+	for(; left < argc && strncmp(argv[left], "--", 2) == 0; left++) {
+		if(strcmp(argv[left], "--fork") == 0)
+			opts.mode = spawn_mode::FORK;
+		else if(strcmp(argv[left], "--spawn") == 0)
+			opts.mode = spawn_mode::SPAWN;
+		else if(strcmp(argv[left], "--zygote") == 0)
+			opts.mode = spawn_mode::ZYGOTE;
+		else if(strcmp(argv[left], "--teardown") == 0)
+			opts.teardown = true;
+		else if(strcmp(argv[left], "--trace") == 0)
+			opts.trace = true;
+		else if(strcmp(argv[left], "--stats") == 0)
+			opts.stats = true;
+		else if(strcmp(argv[left], "--meter") == 0)
+			opts.meter = true;
+		else if(strncmp(argv[left], "--meter=", 8) == 0) {
+			std::string_view ms = argv[left] + 8;
+			auto res = std::from_chars(ms.data(), ms.data() + ms.size(), opts.meter_interval);
+			if(res.ec != std::errc{} || res.ptr != ms.data() + ms.size() || opts.meter_interval < 0) {
+				std::cerr << "piper : invalid meter interval \"" << ms << "\"\n";
+				return 1;
 			}
-
-			close(real_stdin);
-			std::cerr << "Executed : " << *commands[i] << std::endl;
-			execv(*commands[i], commands[i]);
-			sys_err("execv failed");
-		} else {
-			if(not_end) {
-				Piping::equalize(STDIN_FILENO, curr_pipe.read_end());
-				curr_pipe.close_pipe();
+			opts.meter = true;
+		}
+		else if(strncmp(argv[left], "--meter-dump=", 13) == 0) {
+			opts.meter = true;
+			opts.meter_dump = argv[left] + 13;
+		}
+		else if(strcmp(argv[left], "--pipe-size=auto") == 0)
+			opts.pipe_autosize = true;
+		else if(strncmp(argv[left], "--pipe-size=", 12) == 0) {
+			std::string_view size = argv[left] + 12;
+			long long bytes = 0;
+			auto res = std::from_chars(size.data(), size.data() + size.size(), bytes);
+			std::string_view unit(res.ptr, size.data() + size.size() - res.ptr);
+			int shift = -1;
+			if(unit.empty()) shift = 0;
+			else if(unit == "K" || unit == "k") shift = 10;
+			else if(unit == "M" || unit == "m") shift = 20;
+			// range checked before the unit is applied, so the shift can't overflow
+			if(res.ec != std::errc{} || shift == -1 || bytes <= 0 || bytes > (INT_MAX >> shift)) {
+				std::cerr << "piper : invalid pipe size \"" << size << "\"\n";
+				return 1;
 			}
+			opts.pipe_capacity = static_cast<int>(bytes << shift);
+		}
+		else {
+			std::cerr << "piper : unknown option \"" << argv[left] << "\"\n";
+			return 1;
 		}
 	}
 
-	Piping::equalize(STDIN_FILENO, real_stdin);
-	while(wait(NULL) > 0);
-}
-
-int main(int argc, char** argv) {
-	std::vector<char**> vec;
-	int left = 1;
-	for(int i = 1; i <= argc; i++) {
-		if(!argv[i] or (strcmp(argv[i], "/") == 0)) {
-			vec.push_back(&argv[left]);
-			argv[i] = nullptr;
-			left = i;
-			++left;
+	// forked before anything else grows the heap
+	std::unique_ptr<Zygote> zygote;
+	if(opts.mode == spawn_mode::ZYGOTE)
+		zygote = std::make_unique<Zygote>();
+
+	// words and argv arrays live in one arena, envp is the scope's cached one, see CommandLine
+	auto env = scope::Scope::from_environ(environ);
+	CommandLine line;
+	line.build(std::span<char*>(argv + left, argv + argc), env.envp());
+	auto vec = line.commands();
+
+	// stderr, stdout belongs to the last stage
+	if(opts.trace) {
+		for(auto cmd : vec) {
+			std::cerr << "args : ";
+			while(*cmd) {
+				std::cerr << "\"" << *cmd << "\" ";
+				++cmd;
+			}
+			std::cerr << std::endl;
 		}
 	}
 	
+	// `time` in front of the first command times the whole pipeline
+	if(*vec.front() && strcmp(*vec.front(), "time") == 0) {
+		++vec.front();
+		opts.stats = true;
+	}
 	for(auto cmd : vec) {
-		std::cout << "args : ";
-		while(*cmd) {
-			std::cout << "\"" << *cmd << "\" ";
-			++cmd;
+		if(!*cmd) {
+			std::cerr << "piper : empty command\n";
+			return 1;
 		}
-		std::cout << std::endl;
 	}
-	
-	run_pipe(vec);
+
+	Reaper reaper;
+	reaper.set_teardown(opts.teardown);
+	if(zygote)
+		reaper.attach(*zygote);
+	CommandTable table;
+	std::unique_ptr<EdgeMeter> meter;
+	if(opts.meter)
+		meter = std::make_unique<EdgeMeter>();
+
+	std::size_t id = run_pipe(reaper, table, line, opts, meter.get(), zygote.get());
+	if(meter) {
+		int timeout = (opts.meter_interval > 0) ? opts.meter_interval : -1;
+		auto next = EdgeMeter::clock::now() + std::chrono::milliseconds(timeout);
+		while(!reaper.finished(id)) {
+			reaper.poll(timeout);
+			if(timeout == -1 || EdgeMeter::clock::now() < next) continue;
+			next += std::chrono::milliseconds(timeout);
+			meter->report();
+			if(!opts.meter_dump.empty()) meter->dump(opts.meter_dump);
+		}
+		meter->join();
+		meter->report();
+		if(!opts.meter_dump.empty()) meter->dump(opts.meter_dump);
+	}
+
+	const Job& job = reaper.wait(id);
+	if(opts.stats)
+		print_stats(job, vec);
+	int rc = exit_code(job.stages.back().status);
+	line.reset();
+	return rc;
 }
 
 
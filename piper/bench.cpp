@@ -0,0 +1,188 @@
+#include "piping.hpp"
+#include "spawn.hpp"
+#include "zerocopy.hpp"
+#include "builtins.hpp"
+#include "zygote.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+/*
+usage : bench --spawn [launches]
+       bench --copy [MiB]
+--spawn times launching /bin/true in every spawn_mode while the process holds
+        0, 128 and 512 MiB of touched heap. fork() copies the page tables so its
+        cost grows with the heap, vfork() shouldn't, and the Zygote is
+        forked before the heap grows so its launches shouldn't either.
+--copy  moves a MiB sized file (default 1024) through the cat and tee builtins' paths,
+        splice/tee against the read/write loop they fall back to, best of 3 in GB/s.
+        Every run has the same reader on the far end, a splice into /dev/null.
+*/
+using bench_clock = std::chrono::steady_clock;
+
+static double launch_us(spawn_mode mode, int launches) {
+	char arg0[] = "true";
+	char* argv[] = {arg0, nullptr};
+	double total = 0;
+	for(int i = 0; i < launches; i++) {
+		auto start = bench_clock::now();
+		pid_t pid = spawn_stage(mode, "/bin/true", argv, environ, STDIN_FILENO, STDOUT_FILENO);
+		total += std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+		waitpid(pid, nullptr, 0);
+	}
+	return total / launches;
+}
+
+// up to the SPAWNED reply, the exit report is waited for outside the clock
+static double zygote_us(Zygote& zygote, int launches) {
+	char arg0[] = "true";
+	char* argv[] = {arg0, nullptr};
+	double total = 0;
+	for(int i = 0; i < launches; i++) {
+		auto start = bench_clock::now();
+		remote_stage child = zygote.spawn("/bin/true", argv, environ, STDIN_FILENO, STDOUT_FILENO);
+		total += std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+		if(child.pidfd != -1) close(child.pidfd);
+
+		zygote_report rep;
+		while(!zygote.next_exit(rep) || rep.pid != child.pid) {
+			if(zygote.lost()) sys_err("bench : lost the zygote");
+			pollfd pfd{zygote.fd(), POLLIN, 0};
+			if(!zygote.has_pending()) poll(&pfd, 1, -1);
+		}
+	}
+	return total / launches;
+}
+
+static int bench_spawn(int launches) {
+	// forked while the heap is still tiny, the way piper --zygote does it
+	Zygote zygote;
+	std::printf("%10s %12s %12s %12s\n", "heap(MiB)", "spawn(us)", "fork(us)", "zygote(us)");
+	for(std::size_t mib : {0, 128, 512}) {
+		std::vector<char> heap(mib << 20);
+		// every page touched, so fork() has real page tables to copy
+		std::memset(heap.data(), 1, heap.size());
+		double spawn = launch_us(spawn_mode::SPAWN, launches);
+		double fork = launch_us(spawn_mode::FORK, launches);
+		double remote = zygote_us(zygote, launches);
+		std::printf("%10zu %12.1f %12.1f %12.1f\n", mib, spawn, fork, remote);
+	}
+	return 0;
+}
+
+using cat_mover = int (*)(const char* name, int in_fd, int out_fd);
+using tee_mover = bool (*)(int in_fd, int out_fd, int sink_fd);
+
+static bool splice_tee(int in_fd, int out_fd, int sink_fd) {
+	return zcopy::duplicate(in_fd, out_fd, sink_fd) == zcopy::status::DONE;
+}
+
+// what the tee builtin does when duplicate() can't
+static bool copy_tee(int in_fd, int out_fd, int sink_fd) {
+	char buf[builtins::buf_size];
+	ssize_t n;
+	while((n = builtins::read_some(in_fd, buf, sizeof buf)) > 0)
+		if(!builtins::write_all(out_fd, buf, n) || !builtins::write_all(sink_fd, buf, n)) return false;
+	return n == 0;
+}
+
+static int open_null() {
+	int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if(fd == -1) sys_err("bench : open(/dev/null) failed");
+	return fd;
+}
+
+// reads fd to EOF and closes it
+static std::thread drain(int fd) {
+	return std::thread([fd] {
+		int null_fd = open_null();
+		zcopy::forward(fd, null_fd);
+		close(null_fd);
+		close(fd);
+	});
+}
+
+static double gbps(std::size_t bytes, bench_clock::time_point start) {
+	return bytes / std::chrono::duration<double>(bench_clock::now() - start).count() / 1e9;
+}
+
+// file -> pipe, the cat builtin
+static double cat_run(const char* path, std::size_t bytes, cat_mover move) {
+	int in_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(in_fd == -1) sys_err("bench : open() failed");
+	Piping out;
+	auto start = bench_clock::now();
+	std::thread reader = drain(out.release_read());
+	int rc = move("cat", in_fd, out.write_end());
+	out.close_write();
+	reader.join();
+	double res = gbps(bytes, start);
+	close(in_fd);
+	return rc == 0 ? res : 0;
+}
+
+// pipe -> pipe + /dev/null, the tee builtin with one FILE
+static double tee_run(const char* path, std::size_t bytes, tee_mover move) {
+	int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(file_fd == -1) sys_err("bench : open() failed");
+	Piping in;
+	Piping out;
+	int sink_fd = open_null();
+	auto start = bench_clock::now();
+	std::thread feeder([file_fd, in_fd = in.release_write()] {
+		builtins::pass_fd("feeder", file_fd, in_fd);
+		close(in_fd);
+	});
+	std::thread reader = drain(out.release_read());
+	bool ok = move(in.read_end(), out.write_end(), sink_fd);
+	out.close_write();
+	feeder.join();
+	reader.join();
+	double res = gbps(bytes, start);
+	close(sink_fd);
+	close(file_fd);
+	return ok ? res : 0;
+}
+
+template <typename Fn>
+static double best_of_3(Fn&& fn) {
+	double best = 0;
+	for(int i = 0; i < 3; i++) best = std::max(best, fn());
+	return best;
+}
+
+static int bench_copy(std::size_t mib) {
+	char path[] = "/tmp/piper-bench-XXXXXX";
+	int fd = mkostemp(path, O_CLOEXEC);
+	if(fd == -1) sys_err("bench : mkostemp() failed");
+	std::vector<char> block(1 << 20, 'x');
+	for(std::size_t i = 0; i < mib; i++)
+		if(!builtins::write_all(fd, block.data(), block.size())) sys_err("bench : write() failed");
+	close(fd);
+	std::size_t bytes = mib << 20;
+
+	std::printf("%-6s %14s %14s\n", "path", "splice(GB/s)", "rw(GB/s)");
+	std::printf("%-6s %14.2f %14.2f\n", "cat",
+		best_of_3([&] { return cat_run(path, bytes, builtins::pass_fd); }),
+		best_of_3([&] { return cat_run(path, bytes, builtins::copy_fd); }));
+	std::printf("%-6s %14.2f %14.2f\n", "tee",
+		best_of_3([&] { return tee_run(path, bytes, splice_tee); }),
+		best_of_3([&] { return tee_run(path, bytes, copy_tee); }));
+	unlink(path);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if(argc >= 2 && std::strcmp(argv[1], "--spawn") == 0)
+		return bench_spawn(argc >= 3 ? std::atoi(argv[2]) : 200);
+	if(argc >= 2 && std::strcmp(argv[1], "--copy") == 0)
+		return bench_copy(argc >= 3 ? std::atoi(argv[2]) : 1024);
+	std::fprintf(stderr, "usage : bench --spawn [launches] | --copy [MiB]\n");
+	return 2;
+}
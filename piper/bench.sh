@@ -0,0 +1,55 @@
+#!/bin/sh
+# usage : bench.sh pipes [piper] [MiB]
+#         bench.sh launch [piper] [runs]
+# Runs piper --stats and sums what its table reports, piper defaults to ./piper.
+# pipes : /bin/cat of a MiB sized file (default 256) into /usr/bin/wc -c,
+#         once per --pipe-size, context switches of both stages and wall time.
+#         Absolute paths keep the builtins out, only processes block on a pipe.
+# launch : a pipeline of 8 /bin/true stages per spawn mode, the "total" real of
+#          --stats averaged over runs (default 50), from the first launch to the last exit.
+#          piper's heap stays tiny here, bench --spawn sweeps every mode over 0/128/512 MiB.
+set -eu
+
+mode=${1:-}
+piper=${2:-./piper}
+
+# the stage rows of --stats : vcsw and ivcsw summed over every stage, the slowest real
+sum_stats() {
+	awk '$1 ~ /^[0-9]+$/ { vcsw += $(NF-2); ivcsw += $(NF-1); if($(NF-6) > real) real = $(NF-6) }
+		END { printf "%10d %10d %10.3f\n", vcsw, ivcsw, real }'
+}
+
+bench_pipes() {
+	mib=${1:-256}
+	file=$(mktemp)
+	trap 'rm -f "$file"' EXIT
+	head -c $((mib * 1048576)) /dev/zero > "$file"
+	printf '%-10s %10s %10s %10s\n' "pipe-size" "vcsw" "ivcsw" "real(s)"
+	for size in default 16k 64k 256k 1M; do
+		opt=--pipe-size=$size
+		[ "$size" = default ] && opt=--spawn
+		printf '%-10s ' "$size"
+		"$piper" --stats "$opt" /bin/cat "$file" / /usr/bin/wc -c 2>&1 >/dev/null | sum_stats
+	done
+}
+
+bench_launch() {
+	runs=${1:-50}
+	set -- /bin/true
+	for i in 2 3 4 5 6 7 8; do set -- "$@" / /bin/true; done
+	printf '%-8s %12s\n' "mode" "real(ms)"
+	for mode in spawn fork zygote; do
+		printf '%-8s ' "$mode"
+		n=0
+		while [ $n -lt "$runs" ]; do
+			"$piper" --stats "--$mode" "$@" 2>&1 >/dev/null
+			n=$((n + 1))
+		done | awk -v runs="$runs" '$1 == "total" { real += $2 } END { printf "%12.3f\n", real * 1000 / runs }'
+	done
+}
+
+case "$mode" in
+	pipes) bench_pipes "${3:-}" ;;
+	launch) bench_launch "${3:-}" ;;
+	*) echo "usage : bench.sh pipes|launch [piper] [MiB | runs]" >&2; exit 2 ;;
+esac
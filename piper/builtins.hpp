@@ -0,0 +1,365 @@
+#pragma once
+#include "piping.hpp"
+#include "zerocopy.hpp"
+#include <unordered_map>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <csignal>
+#include <climits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+Builtin stages run inside the shell on their own thread.
+They get the stage's stdin/stdout fds (owned by the caller) and argv,
+and return the stage's exit code.
+*/
+using builtin_fn = int (*)(int in_fd, int out_fd, char** argv);
+
+namespace builtins {
+
+constexpr std::size_t buf_size = 64 * 1024;
+
+// the code a process gets when SIGPIPE kills it, reported instead of dying
+constexpr int broken_pipe = 128 + SIGPIPE;
+
+inline ssize_t read_some(int fd, char* buf, std::size_t n) noexcept {
+	ssize_t res;
+	while((res = read(fd, buf, n)) == -1 && errno == EINTR);
+	return res;
+}
+
+inline bool write_all(int fd, const char* buf, std::size_t n) noexcept {
+	while(n > 0) {
+		ssize_t res = write(fd, buf, n);
+		if(res == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) { writer_stalled(fd); continue; }
+			return false;
+		}
+		buf += res;
+		n -= res;
+	}
+	return true;
+}
+
+inline int fail(const char* name, const char* what) noexcept {
+	if(errno == EPIPE) return broken_pipe;
+	std::fprintf(stderr, "%s : %s : %s\n", name, what, std::strerror(errno));
+	return 1;
+}
+
+inline int usage(const char* name) noexcept {
+	std::fprintf(stderr, "%s : unsupported arguments\n", name);
+	return 2;
+}
+
+inline int copy_fd(const char* name, int in_fd, int out_fd) noexcept {
+	char buf[buf_size];
+	ssize_t n;
+	while((n = read_some(in_fd, buf, sizeof buf)) > 0)
+		if(!write_all(out_fd, buf, n)) return fail(name, "write failed");
+	return (n == -1) ? fail(name, "read failed") : 0;
+}
+
+// kernel side copy when the fds allow it, user-space loop otherwise
+inline int pass_fd(const char* name, int in_fd, int out_fd) noexcept {
+	switch(zcopy::forward(in_fd, out_fd)) {
+	case zcopy::status::DONE : return 0;
+	case zcopy::status::FAILED : return fail(name, "splice failed");
+	default : return copy_fd(name, in_fd, out_fd);
+	}
+}
+
+// argv from arg on once a leading "--" is skipped, null when an option is left in it
+inline char** operands(char** arg) noexcept {
+	if(*arg && std::strcmp(*arg, "--") == 0) return arg + 1;
+	for(char** it = arg; *it; ++it)
+		if(**it == '-' && (*it)[1]) return nullptr;
+	return arg;
+}
+
+// "-" is the stage's stdin, anything else is opened, -1 when that fails
+inline int open_input(const char* name, int in_fd) noexcept {
+	if(std::strcmp(name, "-") == 0) return in_fd;
+	return open(name, O_RDONLY | O_CLOEXEC);
+}
+
+inline void close_input(int fd, int in_fd) noexcept {
+	if(fd != in_fd) close(fd);
+}
+
+// cat [--] [FILE | -]...
+inline char** cat_args(char** argv) noexcept {
+	return operands(argv + 1);
+}
+
+inline int cat(int in_fd, int out_fd, char** argv) {
+	char** files = cat_args(argv);
+	if(!files) return usage(*argv);
+	if(!*files) return pass_fd(*argv, in_fd, out_fd);
+
+	// like GNU cat, a file that fails is reported and the rest still go through
+	int rc = 0;
+	for(; *files; ++files) {
+		int fd = open_input(*files, in_fd);
+		if(fd == -1) { rc = fail(*argv, *files); continue; }
+		int res = pass_fd(*argv, fd, out_fd);
+		close_input(fd, in_fd);
+		if(res == broken_pipe) return res;
+		if(res != 0) rc = res;
+	}
+	return rc;
+}
+
+// tee [-a] [--] [FILE]...
+inline char** tee_args(char** argv, bool& append) noexcept {
+	char** arg = argv + 1;
+	append = (*arg && std::strcmp(*arg, "-a") == 0);
+	return operands(arg + append);
+}
+
+inline int tee(int in_fd, int out_fd, char** argv) {
+	bool append = false;
+	char** arg = tee_args(argv, append);
+	if(!arg) return usage(*argv);
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+
+	std::vector<int> sinks;
+	auto close_sinks = [&sinks] { for(int fd : sinks) close(fd); };
+	for(; *arg; ++arg) {
+		int fd = open(*arg, flags, 0666);
+		if(fd == -1) { int rc = fail(*argv, *arg); close_sinks(); return rc; }
+		sinks.push_back(fd);
+	}
+
+	int rc = 0;
+	auto st = zcopy::status::UNSUPPORTED;
+	if(sinks.empty())
+		rc = pass_fd(*argv, in_fd, out_fd);
+	else if(sinks.size() == 1)
+		st = zcopy::duplicate(in_fd, out_fd, sinks.front());
+
+	if(st == zcopy::status::FAILED)
+		rc = fail(*argv, "tee failed");
+	else if(st == zcopy::status::UNSUPPORTED && !sinks.empty()) {
+		char buf[buf_size];
+		ssize_t n;
+		while((n = read_some(in_fd, buf, sizeof buf)) > 0) {
+			if(!write_all(out_fd, buf, n)) { rc = fail(*argv, "write failed"); break; }
+			for(int fd : sinks)
+				if(!write_all(fd, buf, n)) rc = fail(*argv, "write failed");
+		}
+		if(n == -1) rc = fail(*argv, "read failed");
+	}
+	close_sinks();
+	return rc;
+}
+
+// head [-n N | -nN | -N]... [--] [FILE | -]...
+inline char** head_args(char** argv, unsigned long long& lines) noexcept {
+	char** arg = argv + 1;
+	for(; *arg && **arg == '-' && (*arg)[1] && std::strcmp(*arg, "--") != 0; ++arg) {
+		std::string_view opt = *arg;
+		if(opt == "-n") {
+			if(!arg[1]) return nullptr;
+			opt = *++arg;
+		}
+		else if(opt.starts_with("-n"))
+			opt.remove_prefix(2);
+		else
+			opt.remove_prefix(1);
+
+		auto res = std::from_chars(opt.data(), opt.data() + opt.size(), lines);
+		if(res.ec != std::errc{} || res.ptr != opt.data() + opt.size())
+			return nullptr;
+	}
+	return operands(arg);
+}
+
+// the first `lines` lines of fd, 1 when a read or write fails
+inline int head_fd(const char* name, int fd, int out_fd, unsigned long long lines) {
+	char buf[buf_size];
+	while(lines > 0) {
+		ssize_t n = read_some(fd, buf, sizeof buf);
+		if(n == -1) return fail(name, "read failed");
+		if(n == 0) break;
+
+		const char* it = buf;
+		const char* end = buf + n;
+		while(lines > 0 && it < end) {
+			auto nl = static_cast<const char*>(std::memchr(it, '\n', end - it));
+			if(!nl) { it = end; break; }
+			it = nl + 1;
+			--lines;
+		}
+		if(!write_all(out_fd, buf, it - buf)) return fail(name, "write failed");
+	}
+	return 0;
+}
+
+inline int head(int in_fd, int out_fd, char** argv) {
+	unsigned long long lines = 10;
+	char** files = head_args(argv, lines);
+	if(!files) return usage(*argv);
+	if(!*files) return head_fd(*argv, in_fd, out_fd, lines);
+
+	// a "==> FILE <==" header in front of every file once there are several
+	bool headers = (files[1] != nullptr);
+	int rc = 0;
+	for(char** file = files; *file; ++file) {
+		int fd = open_input(*file, in_fd);
+		if(fd == -1) { rc = fail(*argv, *file); continue; }
+		if(headers) {
+			const char* shown = (fd == in_fd) ? "standard input" : *file;
+			char title[PATH_MAX + 32];
+			int len = std::snprintf(title, sizeof title, "%s==> %s <==\n", (file == files) ? "" : "\n", shown);
+			len = std::min<int>(len, sizeof title - 1);
+			if(!write_all(out_fd, title, len)) { close_input(fd, in_fd); return fail(*argv, "write failed"); }
+		}
+		int res = head_fd(*argv, fd, out_fd, lines);
+		close_input(fd, in_fd);
+		if(res == broken_pipe) return res;
+		if(res != 0) rc = res;
+	}
+	return rc;
+}
+
+// wc [-l] [-w] [-c] [--] [FILE | -]...
+struct wc_counts {
+	unsigned long long lines = 0, words = 0, bytes = 0;
+};
+
+inline char** wc_args(char** argv, bool& want_lines, bool& want_words, bool& want_bytes) noexcept {
+	char** arg = argv + 1;
+	for(; *arg && **arg == '-' && (*arg)[1] && std::strcmp(*arg, "--") != 0; ++arg) {
+		for(const char* c = *arg + 1; *c; ++c) {
+			switch(*c) {
+			case 'l' : want_lines = true; break;
+			case 'w' : want_words = true; break;
+			case 'c' : want_bytes = true; break;
+			default : return nullptr;
+			}
+		}
+	}
+	return operands(arg);
+}
+
+inline bool wc_fd(int fd, wc_counts& counts) noexcept {
+	bool in_word = false;
+	char buf[buf_size];
+	ssize_t n;
+	while((n = read_some(fd, buf, sizeof buf)) > 0) {
+		counts.bytes += n;
+		for(ssize_t i = 0; i < n; i++) {
+			unsigned char c = buf[i];
+			counts.lines += (c == '\n');
+			bool space = std::isspace(c);
+			counts.words += (!space && !in_word);
+			in_word = !space;
+		}
+	}
+	return n == 0;
+}
+
+inline int wc(int in_fd, int out_fd, char** argv) {
+	bool want_lines = false, want_words = false, want_bytes = false;
+	char** files = wc_args(argv, want_lines, want_words, want_bytes);
+	if(!files) return usage(*argv);
+	if(!(want_lines || want_words || want_bytes))
+		want_lines = want_words = want_bytes = true;
+
+	// no operand counts stdin, without a name on its line
+	bool named = (*files != nullptr);
+	char dash[] = "-";
+	char* stdin_only[] = {dash, nullptr};
+	if(!named) files = stdin_only;
+	std::size_t inputs = 0;
+	for(char** file = files; *file; ++file) ++inputs;
+
+	// GNU's widths : bare for one count of one input, else wide enough for the
+	// total size of the regular files, 7 as soon as any input isn't one
+	int count = want_lines + want_words + want_bytes;
+	int width = 0;
+	if(count > 1 || inputs > 1) {
+		unsigned long long total = 0;
+		int least = 1;
+		for(char** file = files; *file; ++file) {
+			struct stat st;
+			int res = (std::strcmp(*file, "-") == 0) ? fstat(in_fd, &st) : stat(*file, &st);
+			if(res == 0 && S_ISREG(st.st_mode)) total += st.st_size;
+			else if(res == 0) least = 7;
+		}
+		for(width = 1; total >= 10; total /= 10) ++width;
+		width = std::max(width, least);
+	}
+
+	auto put = [&](const wc_counts& counts, const char* name) {
+		char out[PATH_MAX + 96];
+		int len = 0;
+		auto num = [&](unsigned long long v) {
+			len += std::snprintf(out + len, sizeof out - len, (len ? " %*llu" : "%*llu"), width, v);
+		};
+		if(want_lines) num(counts.lines);
+		if(want_words) num(counts.words);
+		if(want_bytes) num(counts.bytes);
+		if(name) len += std::snprintf(out + len, sizeof out - len, " %s", name);
+		len = std::min<int>(len, sizeof out - 2);
+		out[len++] = '\n';
+		return write_all(out_fd, out, len);
+	};
+
+	int rc = 0;
+	wc_counts total;
+	for(char** file = files; *file; ++file) {
+		int fd = open_input(*file, in_fd);
+		if(fd == -1) { rc = fail(*argv, *file); continue; }
+		wc_counts counts;
+		bool read_ok = wc_fd(fd, counts);
+		close_input(fd, in_fd);
+		if(!read_ok) { rc = fail(*argv, *file); continue; }
+		total.lines += counts.lines;
+		total.words += counts.words;
+		total.bytes += counts.bytes;
+		if(!put(counts, named ? *file : nullptr)) return fail(*argv, "write failed");
+	}
+	if(inputs > 1 && !put(total, "total")) return fail(*argv, "write failed");
+	return rc;
+}
+}
+
+struct builtin_entry {
+	builtin_fn run;
+	bool (*accepts)(char** argv) noexcept; // every option in argv is one the builtin implements
+};
+
+/*
+Only bare names are builtins, an explicit path always means exec.
+A builtin is picked only when it accepts the whole argv, `head -c 3` or
+`cat -n` go on to PATH and run the real binary.
+*/
+inline builtin_fn find_builtin(char** argv) {
+	static const std::unordered_map<std::string_view, builtin_entry, string_hash, std::equal_to<>> table{
+		{"cat", {builtins::cat, [](char** argv) noexcept { return builtins::cat_args(argv) != nullptr; }}},
+		{"head", {builtins::head, [](char** argv) noexcept {
+			unsigned long long lines;
+			return builtins::head_args(argv, lines) != nullptr;
+		}}},
+		{"tee", {builtins::tee, [](char** argv) noexcept {
+			bool append;
+			return builtins::tee_args(argv, append) != nullptr;
+		}}},
+		{"wc", {builtins::wc, [](char** argv) noexcept {
+			bool lines = false, words = false, bytes = false;
+			return builtins::wc_args(argv, lines, words, bytes) != nullptr;
+		}}}
+	};
+	auto it = table.find(*argv);
+	return (it == table.end() || !it->second.accepts(argv)) ? nullptr : it->second.run;
+}
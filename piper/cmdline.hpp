@@ -0,0 +1,124 @@
+#pragma once
+#include "piping.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <sys/mman.h>
+
+/*
+Everything exec needs for one command line, in a single arena :
+
+	char** commands[n] | char* argv[words + n] | word bytes
+
+build() measures the line first and then fills the arena in one pass,
+so nothing moves once a pointer is handed out and the arena only grows
+(one mmap, never malloc) when a line is bigger than every line before it.
+reset() is O(1), call it once the job is reaped : builtin stages and
+print_stats() still read the words until then.
+The environment isn't copied, every command line points at the caller's
+envp, scope::Scope::envp() keeps one cached until an export changes it.
+*/
+class CommandLine {
+	public :
+	CommandLine() = default;
+
+	CommandLine(const CommandLine& _) = delete;
+	CommandLine& operator=(const CommandLine& _) = delete;
+
+	~CommandLine() noexcept {
+		if(base != MAP_FAILED) munmap(base, capacity);
+	}
+
+	/*
+	Splits words into commands on "/", a leading, trailing or doubled "/"
+	gives an empty command (argv[0] == nullptr), it is up to the caller to reject it.
+	env is the exported environment every command shares, it is kept as is,
+	not copied, and must stay valid until reset().
+	*/
+	template <typename Words>
+	void build(const Words& words, char* const* env) {
+		reset();
+		std::size_t n_commands = 1, n_words = 0, n_bytes = 0;
+		for(std::string_view word : words) {
+			if(word == "/") {
+				++n_commands;
+				continue;
+			}
+			++n_words;
+			n_bytes += word.size() + 1;
+		}
+		reserve((n_commands + n_words + n_commands) * sizeof(char*) + n_bytes);
+
+		auto** cmds = take<char**>(n_commands);
+		auto** args = take<char*>(n_words + n_commands);
+		auto* bytes = take<char>(n_bytes);
+
+		cmds[0] = args;
+		for(std::string_view word : words) {
+			if(word == "/") {
+				*args++ = nullptr;
+				*++cmds = args;
+				continue;
+			}
+			*args++ = copy(bytes, word);
+		}
+		*args = nullptr;
+		this->n_commands = n_commands;
+		this->vars = env;
+	}
+
+	// argv of every command, the span itself lives in the arena and may be edited
+	std::span<char**> commands() const noexcept {
+		return {reinterpret_cast<char***>(base), n_commands};
+	}
+
+	char* const* envp() const noexcept { return vars; }
+
+	// bytes handed out since the last reset()
+	std::size_t size() const noexcept { return used; }
+
+	void reset() noexcept {
+		used = 0;
+		n_commands = 0;
+		vars = nullptr;
+	}
+
+	private :
+	void* base = MAP_FAILED;
+	std::size_t capacity = 0;
+	std::size_t used = 0;
+	std::size_t n_commands = 0;
+	char* const* vars = nullptr;
+
+	static constexpr std::size_t min_capacity = 64 << 10;
+
+	// only called on an empty arena, so there is nothing to carry over
+	void reserve(std::size_t size) {
+		if(size <= capacity) return;
+		std::size_t grown = std::max(capacity ? capacity * 2 : min_capacity, size);
+		void* fresh = mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(fresh == MAP_FAILED) sys_err("CommandLine : mmap() failed");
+		if(base != MAP_FAILED) munmap(base, capacity);
+		base = fresh;
+		capacity = grown;
+	}
+
+	// pointer arrays come first, so every take<T*>() stays aligned
+	template <typename T>
+	T* take(std::size_t count) noexcept {
+		T* res = reinterpret_cast<T*>(static_cast<char*>(base) + used);
+		used += count * sizeof(T);
+		return res;
+	}
+
+	static char* copy(char*& bytes, std::string_view word) noexcept {
+		char* res = bytes;
+		std::memcpy(bytes, word.data(), word.size());
+		bytes[word.size()] = '\0';
+		bytes += word.size() + 1;
+		return res;
+	}
+};
@@ -0,0 +1,188 @@
+#pragma once
+#include "piping.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <csignal>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/*
+Instrumented mode : every pipe between two stages is cut in two
+and a relay thread splices the bytes across, counting them on the way.
+No extra processes and no user-space copies, the cost is one thread
+and one extra pipe per edge.
+*/
+class EdgeMeter {
+	public :
+	using clock = std::chrono::steady_clock;
+
+	EdgeMeter() : started(clock::now()), last_report(started) {}
+
+	EdgeMeter(const EdgeMeter& _) = delete;
+	EdgeMeter& operator=(const EdgeMeter& _) = delete;
+
+	/*
+	Takes ownership of upstream_fd (the read end the writer stage feeds)
+	and returns the read end the next stage should get instead.
+	from and to aren't copied, they must outlive the meter (run_pipe passes
+	argv[0] of the two stages, which stay in the CommandLine arena).
+	Each edge still costs an edge object and a relay std::thread on the heap.
+	*/
+	int insert(int upstream_fd, std::string_view from, std::string_view to, int capacity = 0) {
+		Piping relay_pipe;
+		relay_pipe.new_pipe(capacity);
+
+		auto& e = *edges.emplace_back(std::make_unique<edge>());
+		e.from = from;
+		e.to = to;
+		relays.emplace_back(relay, &e, upstream_fd, relay_pipe.release_write());
+		return relay_pipe.release_read();
+	}
+
+	// human readable, one line per edge
+	void report(FILE* out = stderr) {
+		auto now = clock::now();
+		double dt = std::chrono::duration<double>(now - last_report).count();
+		last_report = now;
+
+		for(std::size_t i = 0; i < edges.size(); i++) {
+			auto& e = *edges[i];
+			std::uint64_t bytes = e.bytes.load(std::memory_order_relaxed);
+			e.rate = (dt > 0) ? (bytes - e.reported) / dt : 0;
+			e.reported = bytes;
+
+			std::fprintf(out, "edge %zu %.*s -> %.*s : %10.2f MiB %10.2f MiB/s  queued %7.1f KiB%s\n",
+				i, static_cast<int>(e.from.size()), e.from.data(), static_cast<int>(e.to.size()), e.to.data(),
+				bytes / 1048576.0,
+				e.rate / 1048576.0,
+				e.queued.load(std::memory_order_relaxed) / 1024.0,
+				e.done.load(std::memory_order_relaxed) ? "  (closed)" : "");
+		}
+	}
+
+	// machine readable, replaces path atomically so readers never see half a dump
+	void dump(const std::string& path) const {
+		std::string tmp = path + ".tmp";
+		FILE* out = std::fopen(tmp.c_str(), "we");
+		if(!out) sys_err("EdgeMeter : dump() failed to open " + tmp);
+
+		std::fprintf(out, "{\"elapsed_s\":%.6f,\"edges\":[",
+			std::chrono::duration<double>(clock::now() - started).count());
+		for(std::size_t i = 0; i < edges.size(); i++) {
+			auto& e = *edges[i];
+			std::fprintf(out, "%s{\"edge\":%zu,\"from\":%s,\"to\":%s,\"bytes\":%llu,\"rate_bps\":%.1f,\"queued\":%d,\"closed\":%s}",
+				i ? "," : "", i, json_string(e.from).c_str(), json_string(e.to).c_str(),
+				static_cast<unsigned long long>(e.bytes.load(std::memory_order_relaxed)),
+				e.rate,
+				e.queued.load(std::memory_order_relaxed),
+				e.done.load(std::memory_order_relaxed) ? "true" : "false");
+		}
+		std::fprintf(out, "]}\n");
+		if(std::fclose(out) != 0 || std::rename(tmp.c_str(), path.c_str()) == -1)
+			sys_err("EdgeMeter : dump() failed to write " + path);
+	}
+
+	// waits for every relay to see EOF
+	void join() {
+		for(auto& t : relays)
+			if(t.joinable()) t.join();
+	}
+
+	~EdgeMeter() { join(); }
+
+	private :
+	struct edge {
+		std::string_view from;
+		std::string_view to;
+		std::atomic<std::uint64_t> bytes{0};
+		std::atomic<int> queued{0}; // bytes waiting in the downstream pipe, a full pipe means a slow reader
+		std::atomic<bool> done{false};
+		std::uint64_t reported = 0;
+		double rate = 0;
+	};
+
+	clock::time_point started;
+	clock::time_point last_report;
+	std::vector<std::unique_ptr<edge>> edges;
+	std::vector<std::thread> relays;
+
+	// length of the well-formed UTF-8 sequence at str[i], 0 when there is none
+	static std::size_t utf8_length(std::string_view str, std::size_t i) noexcept {
+		unsigned char c = str[i];
+		std::size_t len = (c >= 0xc2 && c <= 0xdf) ? 2 : (c >= 0xe0 && c <= 0xef) ? 3 : (c >= 0xf0 && c <= 0xf4) ? 4 : 0;
+		if(!len || i + len > str.size()) return 0;
+		// no overlong forms, no surrogates, nothing past U+10FFFF
+		unsigned char lo = 0x80, hi = 0xbf;
+		if(c == 0xe0) lo = 0xa0;
+		else if(c == 0xed) hi = 0x9f;
+		else if(c == 0xf0) lo = 0x90;
+		else if(c == 0xf4) hi = 0x8f;
+		if(static_cast<unsigned char>(str[i + 1]) < lo || static_cast<unsigned char>(str[i + 1]) > hi) return 0;
+		for(std::size_t k = 2; k < len; k++)
+			if((static_cast<unsigned char>(str[i + k]) & 0xc0) != 0x80) return 0;
+		return len;
+	}
+
+	/*
+	A JSON string literal of a command name : " \ and control bytes are escaped,
+	bytes that aren't UTF-8 become U+FFFD, names are paths and paths are just bytes.
+	*/
+	static std::string json_string(std::string_view str) {
+		std::string res = "\"";
+		for(std::size_t i = 0; i < str.size();) {
+			unsigned char c = str[i];
+			if(c == '"' || c == '\\') {
+				res += '\\';
+				res += c;
+			} else if(c < 0x20 || c == 0x7f) {
+				char esc[8];
+				std::snprintf(esc, sizeof esc, "\\u%04x", c);
+				res += esc;
+			} else if(c >= 0x80) {
+				std::size_t len = utf8_length(str, i);
+				if(len) res += str.substr(i, len);
+				else res += "\\ufffd";
+				i += len ? len : 1;
+				continue;
+			} else {
+				res += c;
+			}
+			++i;
+		}
+		res += '"';
+		return res;
+	}
+
+	static void relay(edge* e, int in_fd, int out_fd) {
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+		while(true) {
+			int queued;
+			if(ioctl(out_fd, FIONREAD, &queued) == 0)
+				e->queued.store(queued, std::memory_order_relaxed);
+
+			ssize_t n = splice(in_fd, nullptr, out_fd, nullptr, 1 << 20, SPLICE_F_MOVE);
+			if(n > 0) {
+				e->bytes.fetch_add(n, std::memory_order_relaxed);
+				continue;
+			}
+			if(n == -1 && errno == EINTR) continue;
+			break;
+		}
+		close(in_fd);
+		close(out_fd);
+		e->queued.store(0, std::memory_order_relaxed);
+		e->done.store(true, std::memory_order_release);
+	}
+};
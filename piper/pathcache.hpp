@@ -0,0 +1,153 @@
+#pragma once
+#include "piping.hpp"
+#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+extern char** environ;
+
+/*
+Maps command names to the executable $PATH resolves them to.
+Entries are filled lazily on the first lookup of a name.
+$PATH is read from the envp the stages are spawned with, which is what
+scope::Scope exports, so a PATH set in the script resolves like the child sees it.
+The whole table is dropped when $PATH itself changes or when a PATH
+directory changes, which is noticed through inotify (one non-blocking
+read per lookup) or by comparing mtimes for the directories that have no
+watch : all of them without inotify, the missing or removed ones with it.
+*/
+class CommandTable {
+	public :
+	CommandTable() {
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	}
+
+	CommandTable(const CommandTable& _) = delete;
+	CommandTable& operator=(const CommandTable& _) = delete;
+
+	// nullptr when nothing in $PATH matches, names with a '/' are returned as-is
+	const char* resolve(const char* name, char* const* envp = environ) {
+		if(std::strchr(name, '/')) return name;
+
+		refresh(path_of(envp));
+		if(auto it = table.find(std::string_view(name)); it != table.end())
+			return it->second.c_str();
+
+		std::string candidate;
+		for(auto& dir : dirs) {
+			candidate.assign(dir.path).append("/").append(name);
+			struct stat st;
+			if(stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0)
+				return table.emplace(name, std::move(candidate)).first->second.c_str();
+		}
+		return nullptr;
+	}
+
+	void invalidate() noexcept {
+		table.clear();
+	}
+
+	std::size_t size() const noexcept { return table.size(); }
+
+	~CommandTable() noexcept {
+		if(inotify_fd != -1) close(inotify_fd);
+	}
+
+	private :
+	struct path_dir {
+		std::string path;
+		struct timespec mtime{};
+		int wd = -1;
+	};
+
+	static constexpr std::uint32_t watch_mask =
+		IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+	int inotify_fd = -1;
+	std::string path_env;
+	bool loaded = false;
+	std::vector<path_dir> dirs;
+	std::unordered_map<std::string, std::string, string_hash, std::equal_to<>> table;
+
+	static struct timespec mtime_of(const std::string& path) noexcept {
+		struct stat st;
+		if(stat(path.c_str(), &st) == -1) return {};
+		return st.st_mtim;
+	}
+
+	static std::string_view path_of(char* const* envp) noexcept {
+		for(; envp && *envp; ++envp)
+			if(std::strncmp(*envp, "PATH=", 5) == 0) return *envp + 5;
+		return "/usr/local/bin:/usr/bin:/bin";
+	}
+
+	// true when the mtime moved, a directory that didn't exist reads as {}
+	static bool touched(path_dir& dir) noexcept {
+		auto mtime = mtime_of(dir.path);
+		if(mtime.tv_sec == dir.mtime.tv_sec && mtime.tv_nsec == dir.mtime.tv_nsec) return false;
+		dir.mtime = mtime;
+		return true;
+	}
+
+	void watch(path_dir& dir) noexcept {
+		if(inotify_fd != -1)
+			dir.wd = inotify_add_watch(inotify_fd, dir.path.c_str(), watch_mask);
+		if(dir.wd == -1)
+			dir.mtime = mtime_of(dir.path);
+	}
+
+	void load(std::string_view env) {
+		for(auto& dir : dirs)
+			if(dir.wd != -1) inotify_rm_watch(inotify_fd, dir.wd);
+		dirs.clear();
+		table.clear();
+		path_env = env;
+		loaded = true;
+
+		while(!env.empty()) {
+			auto sep = env.find(':');
+			std::string_view entry = env.substr(0, sep);
+			env.remove_prefix((sep == env.npos) ? env.size() : sep + 1);
+
+			path_dir dir;
+			dir.path = entry.empty() ? "." : std::string(entry);
+			watch(dir);
+			dirs.push_back(std::move(dir));
+		}
+	}
+
+	void refresh(std::string_view curr) {
+		if(!loaded || curr != path_env) {
+			load(curr);
+			return;
+		}
+
+		if(inotify_fd != -1) {
+			alignas(inotify_event) char buf[4096];
+			ssize_t len;
+			while((len = read(inotify_fd, buf, sizeof buf)) > 0) {
+				table.clear();
+				// a removed directory loses its watch, it goes back to mtime checks until it reappears
+				for(ssize_t off = 0; off < len;) {
+					auto* ev = reinterpret_cast<const inotify_event*>(buf + off);
+					if(ev->mask & IN_IGNORED)
+						for(auto& dir : dirs)
+							if(dir.wd == ev->wd) { dir.wd = -1; dir.mtime = {}; }
+					off += sizeof(inotify_event) + ev->len;
+				}
+			}
+		}
+
+		for(auto& dir : dirs) {
+			if(dir.wd != -1 || !touched(dir)) continue;
+			table.clear();
+			watch(dir);
+		}
+	}
+};
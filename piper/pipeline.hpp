@@ -0,0 +1,90 @@
+#pragma once
+#include "piping.hpp"
+#include "spawn.hpp"
+#include "reaper.hpp"
+#include "builtins.hpp"
+#include "pathcache.hpp"
+#include "meter.hpp"
+#include "zygote.hpp"
+#include "cmdline.hpp"
+#include <string>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct pipe_options {
+	spawn_mode mode = spawn_mode::SPAWN;
+	int pipe_capacity = 0; // 0 = kernel default
+	bool pipe_autosize = false; // grow pipes whose in-process writer keeps stalling
+	bool teardown = false; // SIGPIPE upstream stages as soon as a downstream stage exits
+	bool stats = false; // print a per-stage resource table once the job is done
+	bool meter = false; // count the bytes on every edge, see EdgeMeter
+	int meter_interval = 1000; // ms between status lines, 0 = only at the end
+	std::string meter_dump; // path of the JSON dump, empty = none
+	bool trace = false; // print every command line and launched stage on stderr
+};
+
+/*
+Launches the pipeline and returns its job id, reaping is left to the caller.
+Once a first job warmed up the Reaper's pool and workers, a launch doesn't allocate :
+argv and envp come out of the CommandLine arena, SPAWN stages are vforked without
+file actions and builtins are handed to a parked worker (test.cpp --launch counts it).
+What still allocates : --trace's stream output, every metered edge (EdgeMeter::insert()),
+the first lookup of a command name in the CommandTable and error paths.
+*/
+inline std::size_t run_pipe(
+	Reaper& reaper,
+	CommandTable& table,
+	const CommandLine& line,
+	const pipe_options& opts = {},
+	EdgeMeter* meter = nullptr,
+	Zygote* zygote = nullptr
+) {
+	auto commands = line.commands();
+	std::size_t job = reaper.open_job();
+	Piping prev_pipe;
+	Piping curr_pipe;
+	prev_pipe.close_pipe();
+	curr_pipe.close_pipe();
+	for(std::size_t i = 0; i < commands.size(); i++) {
+		bool not_end = (i + 1 < commands.size());
+
+		if(not_end) { 
+			curr_pipe.new_pipe(opts.pipe_capacity);
+		}
+
+		if(opts.trace)
+			std::cerr << "Executed : " << *commands[i] << std::endl;
+		if(builtin_fn fn = find_builtin(commands[i])) {
+			int in_fd = (prev_pipe.read_end() == -1) ? Piping::duplicate(STDIN_FILENO) : prev_pipe.release_read();
+			int out_fd = not_end ? curr_pipe.release_write() : Piping::duplicate(STDOUT_FILENO);
+			if(in_fd == -1 || out_fd == -1) sys_err("run_pipe : duplicate() failed");
+			if(opts.pipe_autosize && not_end)
+				fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+
+			reaper.add_task(job, fn, in_fd, out_fd, commands[i]);
+		} else if(const char* path = table.resolve(*commands[i], line.envp())) {
+			int in_fd = (prev_pipe.read_end() == -1) ? STDIN_FILENO : prev_pipe.read_end();
+			int out_fd = not_end ? curr_pipe.write_end() : STDOUT_FILENO;
+			if(opts.mode == spawn_mode::ZYGOTE)
+				reaper.add_remote(job, zygote->spawn(path, commands[i], line.envp(), in_fd, out_fd));
+			else if(pid_t pid = spawn_stage(opts.mode, path, commands[i], line.envp(), in_fd, out_fd); pid != -1)
+				reaper.add_pid(job, pid);
+			else
+				reaper.add_exited(job, 127);
+		} else {
+			std::cerr << "piper : " << *commands[i] << " : command not found\n";
+			reaper.add_exited(job, 127);
+		}
+
+		// the stage owns its ends now, a copy left here would hide EOF or EPIPE from it
+		prev_pipe.close_pipe();
+		curr_pipe.close_write();
+		if(meter && not_end)
+			curr_pipe.adopt(meter->insert(curr_pipe.release_read(), *commands[i], *commands[i + 1], opts.pipe_capacity), -1);
+		prev_pipe = std::move(curr_pipe);
+	}
+
+	prev_pipe.close_pipe();
+	return job;
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include "../interpreter/include/utilities.hpp"
+#include <string>
+#include <string_view>
+#include <functional>
+#include <system_error>
+#include <utility>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+using util::string_hash;
+
+inline void sys_err(const char* msg) {
+	throw std::system_error(errno, std::generic_category(), msg);
+}
+
+inline void sys_err(const std::string& msg) {
+	throw std::system_error(errno, std::generic_category(), msg);
+}
+
+class Piping {
+	private :
+	int pipefd[2]{-1, -1};
+	
+	static void close_fd(int& fd) noexcept {
+		if(fd != -1)
+			close(fd);
+		fd = -1;
+	}
+
+	static void close_fd(const int& fd) noexcept {
+		if(fd != -1)
+			close(fd);
+	}
+
+	public :
+	Piping() noexcept { new_pipe(); }
+
+	Piping(const Piping& _) = delete;
+	Piping& operator=(const Piping& _) = delete;
+
+	Piping(Piping&& oth) noexcept {
+		pipefd[0] = std::exchange(oth.pipefd[0], -1);
+		pipefd[1] = std::exchange(oth.pipefd[1], -1);
+	}
+
+	Piping& operator=(Piping&& oth) noexcept {
+		if(this == &oth) return *this;
+		close_fd(pipefd[0]);
+		close_fd(pipefd[1]);
+		pipefd[0] = std::exchange(oth.pipefd[0], -1);
+		pipefd[1] = std::exchange(oth.pipefd[1], -1);
+		return *this;
+	}
+
+	int read_end() const noexcept { return pipefd[0]; }
+	int write_end() const noexcept { return pipefd[1]; }
+
+	// capacity = 0 keeps the kernel default (64 KiB)
+	void new_pipe(int capacity = 0) {
+		close_pipe();
+		if(pipe2(pipefd, O_CLOEXEC) == -1) {
+			throw std::system_error(
+				errno,
+				std::generic_category(),
+				"Piping : new_pipe() failed"
+			);
+		}
+		if(capacity > 0 && set_capacity(pipefd[1], capacity) == -1) {
+			throw std::system_error(
+				errno,
+				std::generic_category(),
+				"Piping : new_pipe() failed to set capacity"
+			);
+		}
+	}
+
+	static int capacity(int fd) noexcept {
+		return fcntl(fd, F_GETPIPE_SZ);
+	}
+
+	// unprivileged processes can't go past /proc/sys/fs/pipe-max-size
+	static int max_capacity() noexcept {
+		static const int max = [] {
+			int res = 1024 * 1024;
+			if(FILE* f = std::fopen("/proc/sys/fs/pipe-max-size", "re")) {
+				if(std::fscanf(f, "%d", &res) != 1) res = 1024 * 1024;
+				std::fclose(f);
+			}
+			return res;
+		}();
+		return max;
+	}
+
+	// the kernel rounds size up to a power of two pages, anything past the limit is clamped
+	static int set_capacity(int fd, int size) noexcept {
+		int res = fcntl(fd, F_SETPIPE_SZ, size);
+		if(res == -1 && errno == EPERM)
+			res = fcntl(fd, F_SETPIPE_SZ, max_capacity());
+		return res;
+	}
+
+	// doubles the pipe behind fd, false once it can't grow anymore
+	static bool grow(int fd) noexcept {
+		int curr = capacity(fd);
+		if(curr == -1 || curr >= max_capacity()) return false;
+		return set_capacity(fd, std::min(curr * 2, max_capacity())) != -1;
+	}
+
+	static int equalize(int targetfd, int sourcefd) noexcept {
+		return dup2(sourcefd, targetfd);
+	}
+
+	static int duplicate(int targetfd) noexcept {
+		return fcntl(targetfd, F_DUPFD_CLOEXEC, 0);
+	}
+
+	// takes ownership of already open ends, -1 leaves that end closed
+	void adopt(int read_fd, int write_fd) noexcept {
+		close_pipe();
+		pipefd[0] = read_fd;
+		pipefd[1] = write_fd;
+	}
+
+	// gives up ownership of an end, the caller is now responsible for closing it
+	int release_read() noexcept { return std::exchange(pipefd[0], -1); }
+	int release_write() noexcept { return std::exchange(pipefd[1], -1); }
+
+	void close_read() noexcept { close_fd(pipefd[0]); }
+	void close_write() noexcept { close_fd(pipefd[1]); }
+
+	void close_pipe() noexcept {
+		close_fd(pipefd[0]);
+		close_fd(pipefd[1]);
+	}
+
+	void cclose_pipe() const noexcept {
+		close_fd(pipefd[0]);
+		close_fd(pipefd[1]);
+	}
+	
+	~Piping() noexcept {
+		close_pipe();
+	}
+};
+
+/*
+Auto pipe size mode : in-process writers get an O_NONBLOCK write end
+and call this whenever a write hit EAGAIN.
+Every stall_limit stalls the pipe is doubled, then it waits for room.
+*/
+constexpr unsigned stall_limit = 4;
+
+inline void writer_stalled(int fd) noexcept {
+	thread_local unsigned stalls = 0;
+	if(++stalls >= stall_limit) {
+		stalls = 0;
+		Piping::grow(fd);
+	}
+	pollfd pfd{fd, POLLOUT, 0};
+	while(poll(&pfd, 1, -1) == -1 && errno == EINTR);
+}
@@ -0,0 +1,513 @@
+#pragma once
+#include "piping.hpp"
+#include "zygote.hpp"
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#include <semaphore>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+using stage_clock = std::chrono::steady_clock;
+
+struct stage_status {
+	pid_t pid = -1; // -1 for stages that run in-process
+	int status = 0; // raw wait status, valid once done
+	bool done = false;
+	stage_clock::time_point started{};
+	stage_clock::time_point ended{};
+	struct rusage usage{}; // for in-process stages only the thread's share
+};
+
+struct Job {
+	std::size_t id = 0;
+	std::pmr::vector<stage_status> stages;
+	std::size_t pending = 0;
+
+	Job(std::size_t id, std::pmr::memory_resource* mem) : id(id), stages(mem) {}
+
+	bool done() const noexcept { return pending == 0; }
+};
+
+// an in-process stage, takes ownership of in_fd and out_fd
+using task_fn = int (*)(int in_fd, int out_fd, char** argv);
+
+// shell style exit code of a raw wait status
+inline int exit_code(int status) noexcept {
+	if(WIFEXITED(status)) return WEXITSTATUS(status);
+	if(WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	return 1;
+}
+
+/*
+Tracks the pids of every launched pipeline without blocking the shell.
+
+Each pid gets a pidfd registered on one epoll instance, so a wakeup costs
+O(ready children) no matter how many jobs are alive, and only pids we
+launched are ever reaped.
+Kernels without pidfd_open fall back to a SIGCHLD self-pipe,
+that mode drains with wait4(-1) and therefore may reap unrelated children.
+
+Launching doesn't touch the heap once the first few jobs warmed it up :
+jobs, their stage arrays and the pid table come out of a pool that keeps
+released blocks for the next job, and in-process stages run on worker
+threads that are parked, not joined, once their task is done.
+*/
+class Reaper {
+	public :
+	Reaper() {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if(epfd == -1) sys_err("Reaper : epoll_create1() failed");
+		jobs.reserve(table_size);
+		by_pid.reserve(table_size);
+
+		int probe = open_pidfd(getpid());
+		if(probe != -1) {
+			close(probe);
+			return;
+		}
+		if(errno != ENOSYS) sys_err("Reaper : pidfd_open() failed");
+
+		use_pidfd = false;
+		if(pipe2(self_pipe, O_CLOEXEC | O_NONBLOCK) == -1) sys_err("Reaper : pipe2() failed");
+		notify_fd = self_pipe[1];
+
+		struct sigaction sa{};
+		sa.sa_handler = on_sigchld;
+		sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+		sigemptyset(&sa.sa_mask);
+		if(sigaction(SIGCHLD, &sa, nullptr) == -1) sys_err("Reaper : sigaction() failed");
+
+		watch(self_pipe[0], self_pipe_key);
+	}
+
+	Reaper(const Reaper& _) = delete;
+	Reaper& operator=(const Reaper& _) = delete;
+
+	std::size_t open_job() {
+		std::size_t id = ++last_id;
+		jobs.try_emplace(id, id, &pool);
+		return id;
+	}
+
+	void add_pid(std::size_t id, pid_t pid) {
+		Job& job = jobs.at(id);
+		std::size_t stage = job.stages.size();
+		job.stages.push_back({pid});
+		job.stages.back().started = stage_clock::now();
+		++job.pending;
+
+		if(!use_pidfd) {
+			if(auto it = orphans.find(pid); it != orphans.end()) {
+				finish(job, stage, it->second.status, it->second.usage);
+				orphans.erase(it);
+				return;
+			}
+			by_pid[pid] = {id, stage, -1, false};
+			return;
+		}
+
+		int pidfd = open_pidfd(pid);
+		if(pidfd == -1) sys_err("Reaper : pidfd_open() failed");
+		by_pid[pid] = {id, stage, pidfd, false};
+		watch(pidfd, static_cast<std::uint64_t>(pid));
+	}
+
+	// a stage that never started, e.g. command not found
+	void add_exited(std::size_t id, int code) {
+		Job& job = jobs.at(id);
+		job.stages.push_back({});
+		job.stages.back().started = stage_clock::now();
+		++job.pending;
+		finish(job, job.stages.size() - 1, W_EXITCODE(code & 0xff, 0), {});
+	}
+
+	// stages launched by the zygote are its children, their exits arrive as reports
+	void attach(Zygote& z) {
+		zygote = &z;
+		watch(z.fd(), zygote_key);
+	}
+
+	/*
+	Takes ownership of child.pidfd, the zygote opened it before the child could be reaped,
+	so it can't point at a recycled pid. Only used to signal it, a non-child's pidfd never reaps.
+	*/
+	void add_remote(std::size_t id, remote_stage child) {
+		Job& job = jobs.at(id);
+		std::size_t stage = job.stages.size();
+		job.stages.push_back({child.pid});
+		job.stages.back().started = stage_clock::now();
+		++job.pending;
+		by_pid[child.pid] = {id, stage, child.pidfd, true};
+	}
+
+	/*
+	Runs fn(in_fd, out_fd, argv) on a worker thread as the next stage of the job,
+	its return value is recorded as the stage's exit code and both fds are
+	closed once it returns. argv must stay valid until the stage is reaped.
+	SIGPIPE is blocked on the workers so a closed pipe shows up as EPIPE
+	instead of killing the shell.
+	*/
+	void add_task(std::size_t id, task_fn fn, int in_fd, int out_fd, char** argv) {
+		Job& job = jobs.at(id);
+		Worker& w = idle_worker();
+		std::size_t stage = job.stages.size();
+		job.stages.push_back({});
+		job.stages.back().started = stage_clock::now();
+		++job.pending;
+
+		w.job = id;
+		w.stage = stage;
+		w.fn = fn;
+		w.in_fd = in_fd;
+		w.out_fd = out_fd;
+		w.argv = argv;
+		++busy;
+		w.start.release();
+	}
+
+	/*
+	Reaps whatever finished, waiting at most timeout_ms (-1 = forever).
+	Returns the number of stages reaped, call it from the main loop with 0
+	to keep background jobs moving.
+	*/
+	std::size_t poll(int timeout_ms) {
+		// reports the zygote queued while a spawn waited for its reply never wake epoll
+		std::size_t reaped = (zygote && zygote->has_pending()) ? drain_zygote() : 0;
+
+		epoll_event events[64];
+		int n = epoll_wait(epfd, events, std::size(events), reaped ? 0 : timeout_ms);
+		if(n == -1) {
+			if(errno == EINTR) return reaped;
+			sys_err("Reaper : epoll_wait() failed");
+		}
+
+		for(int i = 0; i < n; i++) {
+			if(events[i].data.u64 == zygote_key) {
+				reaped += drain_zygote();
+				continue;
+			}
+			if(events[i].data.u64 == self_pipe_key) {
+				reaped += drain_sigchld();
+				continue;
+			}
+			if(events[i].data.u64 & task_bit) {
+				reaped += join(events[i].data.u64);
+				continue;
+			}
+			reaped += reap(static_cast<pid_t>(events[i].data.u64));
+		}
+		return reaped;
+	}
+
+	const Job& wait(std::size_t id) {
+		const Job& job = jobs.at(id);
+		while(!job.done())
+			poll(-1);
+		return job;
+	}
+
+	bool finished(std::size_t id) const {
+		return jobs.at(id).done();
+	}
+
+	const Job& job(std::size_t id) const {
+		return jobs.at(id);
+	}
+
+	// forgets a finished job
+	void release(std::size_t id) {
+		if(!finished(id))
+			throw std::logic_error("Reaper::release() : job is still running");
+		jobs.erase(id);
+	}
+
+	std::size_t running() const noexcept { return by_pid.size() + busy; }
+
+	/*
+	Teardown policy : once a stage exits, every process stage upstream of it
+	that is still running gets SIGPIPE right away, instead of whenever it
+	next writes (or never, for a producer that computes for a long time between writes).
+	In-process stages can't be signalled, they see EPIPE on their next write.
+	*/
+	void set_teardown(bool enable) noexcept { teardown = enable; }
+
+	~Reaper() noexcept {
+		// a busy worker finishes its task first, only then it sees quit
+		for(auto& w : workers) {
+			w->quit = true;
+			w->start.release();
+			w->thread.join();
+			close(w->efd);
+		}
+		for(auto& [pid, slot] : by_pid)
+			if(slot.pidfd != -1) close(slot.pidfd);
+		if(!use_pidfd) {
+			signal(SIGCHLD, SIG_DFL);
+			notify_fd = -1;
+			close(self_pipe[0]);
+			close(self_pipe[1]);
+		}
+		close(epfd);
+	}
+
+	private :
+	struct slot {
+		std::size_t job;
+		std::size_t stage;
+		int pidfd;
+		bool remote; // a zygote child, reaped by the zygote
+	};
+
+	struct Worker {
+		std::thread thread;
+		std::binary_semaphore start{0};
+		std::atomic<bool> finished{false}; // publishes code and usage to the reaping thread
+		bool quit = false;
+		int efd = -1; // written once per finished task
+		std::size_t job = 0;
+		std::size_t stage = 0;
+		task_fn fn = nullptr;
+		int in_fd = -1;
+		int out_fd = -1;
+		char** argv = nullptr;
+		int code = 0;
+		struct rusage usage{}; // the task's share of the thread's usage
+	};
+
+	struct orphan {
+		int status;
+		struct rusage usage;
+	};
+
+	static constexpr std::uint64_t self_pipe_key = 0; // pid 0 is never a child
+	static constexpr std::uint64_t zygote_key = std::uint64_t{1} << 62;
+	static constexpr std::uint64_t task_bit = std::uint64_t{1} << 63; // pids never reach it, the rest is the worker's index
+	static constexpr std::size_t table_size = 64; // buckets reserved up front, more live entries than that rehash
+
+	static inline int notify_fd = -1;
+
+	int epfd = -1;
+	bool use_pidfd = true;
+	bool teardown = false;
+	Zygote* zygote = nullptr;
+	int self_pipe[2]{-1, -1};
+	std::size_t last_id = 0;
+	std::pmr::unsynchronized_pool_resource pool; // declared before everything it backs
+	std::pmr::unordered_map<std::size_t, Job> jobs{&pool};
+	std::pmr::unordered_map<pid_t, slot> by_pid{&pool};
+	std::pmr::unordered_map<pid_t, orphan> orphans{&pool}; // fallback only, reaped before add_pid()
+	std::vector<std::unique_ptr<Worker>> workers; // a worker's epoll key is task_bit | its index
+	std::vector<Worker*> idle; // capacity never below workers.size(), parking one can't allocate
+	std::size_t busy = 0;
+
+	static void on_sigchld(int) {
+		int saved = errno;
+		char c = 0;
+		if(notify_fd != -1 && write(notify_fd, &c, 1) == -1) {
+			// pipe is full, a wakeup is already pending
+		}
+		errno = saved;
+	}
+
+	void watch(int fd, std::uint64_t key) {
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.u64 = key;
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			sys_err("Reaper : epoll_ctl() failed");
+	}
+
+	void finish(Job& job, std::size_t stage, int status, const struct rusage& usage) {
+		auto& st = job.stages[stage];
+		st.ended = stage_clock::now();
+		st.usage = usage;
+		st.status = status;
+		st.done = true;
+		--job.pending;
+		if(teardown) signal_upstream(job, stage);
+	}
+
+	void signal_upstream(const Job& job, std::size_t stage) noexcept {
+		for(std::size_t i = 0; i < stage; i++) {
+			const auto& st = job.stages[i];
+			if(st.done || st.pid == -1) continue;
+			auto it = by_pid.find(st.pid);
+			if(it == by_pid.end()) continue;
+
+			if(it->second.pidfd != -1)
+				syscall(SYS_pidfd_send_signal, it->second.pidfd, SIGPIPE, nullptr, 0);
+			else if(!it->second.remote)
+				kill(st.pid, SIGPIPE);
+		}
+	}
+
+	std::size_t reap(pid_t pid) {
+		auto it = by_pid.find(pid);
+		if(it == by_pid.end()) return 0;
+
+		int status;
+		struct rusage usage;
+		pid_t res = wait4(pid, &status, WNOHANG, &usage);
+		if(res == 0) return 0;
+		if(res == -1) sys_err("Reaper : wait4() failed");
+
+		close(it->second.pidfd);
+		finish(jobs.at(it->second.job), it->second.stage, status, usage);
+		by_pid.erase(it);
+		return 1;
+	}
+
+	Worker& idle_worker() {
+		if(!idle.empty()) {
+			Worker* w = idle.back();
+			idle.pop_back();
+			return *w;
+		}
+
+		auto w = std::make_unique<Worker>();
+		w->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if(w->efd == -1) sys_err("Reaper : eventfd() failed");
+		try {
+			watch(w->efd, task_bit | workers.size());
+			idle.reserve(workers.size() + 1);
+			w->thread = std::thread(serve, w.get());
+		} catch(...) {
+			close(w->efd);
+			throw;
+		}
+		workers.push_back(std::move(w));
+		return *workers.back();
+	}
+
+	static void serve(Worker* w) {
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+		while(true) {
+			w->start.acquire();
+			if(w->quit) return;
+
+			struct rusage before, after;
+			getrusage(RUSAGE_THREAD, &before);
+			w->code = w->fn(w->in_fd, w->out_fd, w->argv);
+			close(w->in_fd);
+			close(w->out_fd);
+			getrusage(RUSAGE_THREAD, &after);
+			w->usage = since(after, before);
+
+			w->finished.store(true, std::memory_order_release);
+			std::uint64_t one = 1;
+			if(write(w->efd, &one, sizeof one) == -1) {
+				// eventfd counter can't overflow on a single write
+			}
+		}
+	}
+
+	// what the thread used between two snapshots, maxrss is the whole process's anyway
+	static struct rusage since(const struct rusage& now, const struct rusage& then) noexcept {
+		struct rusage d = now;
+		timersub(&now.ru_utime, &then.ru_utime, &d.ru_utime);
+		timersub(&now.ru_stime, &then.ru_stime, &d.ru_stime);
+		d.ru_minflt -= then.ru_minflt;
+		d.ru_majflt -= then.ru_majflt;
+		d.ru_inblock -= then.ru_inblock;
+		d.ru_oublock -= then.ru_oublock;
+		d.ru_nvcsw -= then.ru_nvcsw;
+		d.ru_nivcsw -= then.ru_nivcsw;
+		return d;
+	}
+
+	std::size_t join(std::uint64_t key) {
+		std::size_t index = key & ~task_bit;
+		if(index >= workers.size()) return 0;
+
+		Worker& w = *workers[index];
+		std::uint64_t count;
+		if(read(w.efd, &count, sizeof count) == -1) return 0;
+		if(!w.finished.exchange(false, std::memory_order_acquire)) return 0;
+
+		finish(jobs.at(w.job), w.stage, W_EXITCODE(w.code & 0xff, 0), w.usage);
+		idle.push_back(&w);
+		--busy;
+		return 1;
+	}
+
+	std::size_t drain_zygote() {
+		if(!zygote) return 0;
+		std::size_t reaped = 0;
+		zygote_report rep;
+		while(zygote->next_exit(rep)) {
+			auto it = by_pid.find(rep.pid);
+			if(it == by_pid.end()) continue;
+
+			if(it->second.pidfd != -1) close(it->second.pidfd);
+			finish(jobs.at(it->second.job), it->second.stage, rep.value, rep.usage);
+			by_pid.erase(it);
+			++reaped;
+		}
+		if(zygote->lost()) reaped += drop_zygote();
+		return reaped;
+	}
+
+	/*
+	The helper died, its socket would stay readable at EOF forever.
+	Stages it launched can't be reaped by us, they are killed through their
+	pidfd and recorded as killed by SIGKILL so their jobs still finish.
+	*/
+	std::size_t drop_zygote() {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, zygote->fd(), nullptr);
+		zygote = nullptr;
+
+		std::size_t reaped = 0;
+		for(auto it = by_pid.begin(); it != by_pid.end();) {
+			if(!it->second.remote) {
+				++it;
+				continue;
+			}
+			if(it->second.pidfd != -1) {
+				syscall(SYS_pidfd_send_signal, it->second.pidfd, SIGKILL, nullptr, 0);
+				close(it->second.pidfd);
+			}
+			finish(jobs.at(it->second.job), it->second.stage, SIGKILL, {});
+			it = by_pid.erase(it);
+			++reaped;
+		}
+		return reaped;
+	}
+
+	std::size_t drain_sigchld() {
+		char buf[64];
+		while(read(self_pipe[0], buf, sizeof buf) > 0);
+
+		std::size_t reaped = 0;
+		int status;
+		struct rusage usage;
+		pid_t pid;
+		while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+			auto it = by_pid.find(pid);
+			if(it == by_pid.end()) {
+				orphans[pid] = {status, usage};
+				continue;
+			}
+			finish(jobs.at(it->second.job), it->second.stage, status, usage);
+			by_pid.erase(it);
+			++reaped;
+		}
+		return reaped;
+	}
+};
@@ -0,0 +1,102 @@
+#pragma once
+#include "piping.hpp"
+#include <cstdio>
+#include <csignal>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+/*
+SPAWN = vfork() + execve(), the child shares the shell's memory until it execs,
+        so launching a stage never copies the shell's page tables, see vfork_stage().
+FORK  = fork() + execve(), kept as a fallback for platforms with a poor vfork.
+ZYGOTE = handed to the helper process forked at startup, see Zygote.
+*/
+enum class spawn_mode {
+	SPAWN,
+	FORK,
+	ZYGOTE
+};
+
+/*
+SPAWN's launcher. vfork() borrows the shell's memory and stack until the child
+execs, the same trick glibc's posix_spawn() plays, but the fd moves are plain
+dup2() / close() calls made by the child : posix_spawn_file_actions_t mallocs its
+action list on every launch. Every signal is blocked across the window so no
+handler can run on the borrowed stack, the child restores the mask right before
+execve(). A failed exec is reported through exec_errno, which the parent sees
+because the memory is shared : the child is reaped, the error printed like the
+FORK child prints it, and -1 returned with errno set.
+*/
+inline pid_t vfork_stage(const char* path, char** argv, char* const* envp, int in_fd, int out_fd) {
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	volatile int exec_errno = 0;
+	pid_t pid = vfork();
+	if(pid == 0) {
+		if(in_fd != STDIN_FILENO && (dup2(in_fd, STDIN_FILENO) == -1 || close(in_fd) == -1))
+			exec_errno = errno;
+		else if(out_fd != STDOUT_FILENO && (dup2(out_fd, STDOUT_FILENO) == -1 || close(out_fd) == -1))
+			exec_errno = errno;
+		else {
+			sigprocmask(SIG_SETMASK, &old, nullptr);
+			execve(path, argv, envp);
+			exec_errno = errno;
+		}
+		_exit(127);
+	}
+	int saved = errno;
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+	if(pid == -1) {
+		errno = saved;
+		sys_err("spawn_stage : vfork() failed");
+	}
+	if(exec_errno != 0) {
+		waitpid(pid, nullptr, 0);
+		errno = exec_errno;
+		perror("spawn_stage : execve() failed");
+		errno = exec_errno;
+		return -1;
+	}
+	return pid;
+}
+
+/*
+Launches the executable at path with in_fd as its stdin and out_fd as its stdout.
+Every other fd the shell opens is O_CLOEXEC, so nothing else leaks into the child.
+Returns -1 when SPAWN couldn't exec path, the caller records the stage as exited
+with 127, which is what a FORK or ZYGOTE child exits with in that case.
+*/
+inline pid_t spawn_stage(
+	spawn_mode mode,
+	const char* path,
+	char** argv,
+	char* const* envp,
+	int in_fd,
+	int out_fd
+) {
+	if(mode == spawn_mode::FORK) {
+		pid_t pid = fork();
+		if(pid == -1) sys_err("spawn_stage : fork() failed");
+		if(pid != 0) return pid;
+
+		if(in_fd != STDIN_FILENO) {
+			Piping::equalize(STDIN_FILENO, in_fd);
+			close(in_fd);
+		}
+		if(out_fd != STDOUT_FILENO) {
+			Piping::equalize(STDOUT_FILENO, out_fd);
+			close(out_fd);
+		}
+		execve(path, argv, envp);
+		perror("spawn_stage : execve() failed");
+		_exit(127);
+	}
+
+	return vfork_stage(path, argv, envp, in_fd, out_fd);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "reaper.hpp"
+#include <span>
+#include <cstdio>
+
+inline double seconds(const struct timeval& tv) noexcept {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+inline double seconds(stage_clock::duration d) noexcept {
+	return std::chrono::duration<double>(d).count();
+}
+
+/*
+Per-stage table of a finished job, what `time` and --stats print.
+commands[i] is the argv of stage i, in-process stages are marked with '*',
+their maxrss is the whole shell's.
+*/
+inline void print_stats(const Job& job, std::span<char** const> commands, FILE* out = stderr) {
+	std::fprintf(out, "%-5s %-20s %9s %9s %9s %11s %8s %8s %6s\n",
+		"stage", "command", "real(s)", "user(s)", "sys(s)", "maxrss(KiB)", "vcsw", "ivcsw", "status");
+
+	stage_clock::time_point first = stage_clock::time_point::max();
+	stage_clock::time_point last = stage_clock::time_point::min();
+	double user = 0, sys = 0;
+	for(std::size_t i = 0; i < job.stages.size(); i++) {
+		const auto& st = job.stages[i];
+		const char* name = (i < commands.size()) ? *commands[i] : "?";
+		char label[21];
+		std::snprintf(label, sizeof label, "%s%s", name, (st.pid == -1) ? "*" : "");
+
+		std::fprintf(out, "%-5zu %-20s %9.3f %9.3f %9.3f %11ld %8ld %8ld %6d\n",
+			i, label,
+			seconds(st.ended - st.started),
+			seconds(st.usage.ru_utime),
+			seconds(st.usage.ru_stime),
+			st.usage.ru_maxrss,
+			st.usage.ru_nvcsw,
+			st.usage.ru_nivcsw,
+			exit_code(st.status));
+
+		first = std::min(first, st.started);
+		last = std::max(last, st.ended);
+		user += seconds(st.usage.ru_utime);
+		sys += seconds(st.usage.ru_stime);
+	}
+	if(!job.stages.empty())
+		std::fprintf(out, "%-5s %-20s %9.3f %9.3f %9.3f\n", "total", "", seconds(last - first), user, sys);
+}
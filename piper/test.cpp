@@ -0,0 +1,396 @@
+#include "piping.hpp"
+#include "spawn.hpp"
+#include "reaper.hpp"
+#include "builtins.hpp"
+#include "cmdline.hpp"
+#include "pathcache.hpp"
+#include "zygote.hpp"
+#include "pipeline.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+usage : test [--teardown] [--cmdline] [--builtins] [--launch] [--missing]
+runs every check when no flag is given, fails on the first one that doesn't hold.
+--teardown runs `sh spin.sh / head -n 0` the way run_pipe() wires it, with and without
+           the teardown policy. spin.sh burns CPU before its first write, both runs
+           must end with stage 0 killed by SIGPIPE (141), the teardown one right away.
+--cmdline  builds command lines into one CommandLine : the split on "/", the empty
+           commands and the shared envp, then no operator new at all over repeated build()/reset().
+--builtins checks which argv find_builtin() takes : options a builtin doesn't implement
+           fall back to the binary PATH resolves, and FILE operands of head and wc
+           print what GNU head and wc print for them.
+--launch   run_pipe()s `printf / cat / head -n 2 / wc -l / true` in every spawn mode,
+           a few times to warm up, then counts every malloc() in the process across
+           further launches and reaps : there must be none.
+--missing  run_pipe()s `/nonexistent/... / true` in every spawn mode, the stage that
+           can't exec exits 127 and the job still finishes.
+*/
+static const char spin_script[] =
+	"while :; do\n"
+	"\ti=0\n"
+	"\twhile [ $i -lt 300000 ]; do i=$((i + 1)); done\n"
+	"\techo spin\n"
+	"done\n";
+
+// every operator new in the process, read around the builds with --cmdline
+static std::size_t allocations = 0;
+
+// all kept out of line, once the malloc() and free() inside are inlined
+// GCC pairs them with new and delete and warns -Wmismatched-new-delete
+[[gnu::noinline]] void* operator new(std::size_t size) {
+	++allocations;
+	if(void* ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept { std::free(ptr); }
+[[gnu::noinline]] void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+// every malloc() in the process, operator new and glibc's own ones included, read with --launch
+static std::atomic<std::size_t> mallocs{0};
+
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* ptr, std::size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(std::size_t size) noexcept {
+	mallocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) noexcept {
+	mallocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, std::size_t size) noexcept {
+	mallocs.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) noexcept { __libc_free(ptr); }
+}
+
+static bool check(bool cond, const char* what) {
+	std::printf("%s : %s\n", cond ? "ok" : "FAIL", what);
+	return cond;
+}
+
+static double seconds(const struct timeval& tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// stage 0 of `sh script / head -n 0`
+static stage_status run_spin(const char* script, bool teardown) {
+	Reaper reaper;
+	reaper.set_teardown(teardown);
+	std::size_t job = reaper.open_job();
+
+	Piping pipe;
+	char arg0[] = "sh";
+	char* sh_argv[] = {arg0, const_cast<char*>(script), nullptr};
+	reaper.add_pid(job, spawn_stage(spawn_mode::SPAWN, "/bin/sh", sh_argv, environ, STDIN_FILENO, pipe.write_end()));
+	pipe.close_write();
+
+	int in_fd = pipe.release_read();
+	int out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if(out_fd == -1) sys_err("test : open(/dev/null) failed");
+	char head0[] = "head", head1[] = "-n", head2[] = "0";
+	char* head_argv[] = {head0, head1, head2, nullptr};
+	reaper.add_task(job, find_builtin(head_argv), in_fd, out_fd, head_argv);
+	return reaper.wait(job).stages.front();
+}
+
+static bool test_teardown() {
+	char path[] = "/tmp/piper-spin-XXXXXX";
+	int fd = mkostemp(path, O_CLOEXEC);
+	if(fd == -1) sys_err("test : mkostemp() failed");
+	bool written = builtins::write_all(fd, spin_script, sizeof spin_script - 1);
+	close(fd);
+	if(!written) sys_err("test : write() failed");
+
+	auto lazy = run_spin(path, false);
+	auto eager = run_spin(path, true);
+	unlink(path);
+
+	double lazy_user = seconds(lazy.usage.ru_utime);
+	double eager_user = seconds(eager.usage.ru_utime);
+	std::printf("stage 0 user time : %.3fs without teardown, %.3fs with it\n", lazy_user, eager_user);
+
+	bool ok = check(exit_code(lazy.status) == 141, "without teardown stage 0 dies of SIGPIPE on its first write");
+	ok = check(exit_code(eager.status) == 141, "with teardown stage 0 dies of SIGPIPE") && ok;
+	ok = check(lazy_user > 0.1, "without teardown stage 0 spins until its first write") && ok;
+	ok = check(eager_user < 0.05 && eager_user * 10 < lazy_user, "with teardown stage 0 is stopped before it spins") && ok;
+	return ok;
+}
+
+static bool same_argv(char** argv, std::initializer_list<const char*> want) {
+	for(const char* word : want) {
+		if(!*argv || std::strcmp(*argv, word) != 0) return false;
+		++argv;
+	}
+	return !*argv;
+}
+
+static bool test_cmdline() {
+	char var_a[] = "A=1", var_b[] = "PATH=/bin";
+	char* env[] = {var_a, var_b, nullptr};
+	std::vector<std::string_view> words = {"ls", "-l", "/", "wc", "-c", "/", "/", "grep", "x", "/"};
+	std::vector<std::string_view> lead = {"/", "cat"};
+	std::vector<std::string_view> big(20000, "word");
+
+	CommandLine line;
+	line.build(words, env);
+	auto cmds = line.commands();
+	bool ok = check(cmds.size() == 5, "\"/\" splits 10 words into 5 commands");
+	ok = check(cmds.size() == 5 && same_argv(cmds[0], {"ls", "-l"}) && same_argv(cmds[1], {"wc", "-c"})
+		&& same_argv(cmds[3], {"grep", "x"}), "every argv holds its words, null terminated") && ok;
+	ok = check(cmds.size() == 5 && !*cmds[2] && !*cmds[4], "doubled and trailing \"/\" give empty commands") && ok;
+	ok = check(line.envp() == env, "envp is env itself, not a copy") && ok;
+
+	line.build(lead, env);
+	ok = check(line.commands().size() == 2 && !*line.commands()[0] && same_argv(line.commands()[1], {"cat"}),
+		"a leading \"/\" gives an empty first command") && ok;
+	line.reset();
+	ok = check(line.size() == 0 && line.commands().empty() && !line.envp(), "reset() empties the line") && ok;
+
+	// past the first build the arena is big enough, the big line grows it with mmap
+	std::size_t before = allocations;
+	for(int i = 0; i < 1000; i++) {
+		line.build(words, env);
+		line.reset();
+		line.build(lead, environ);
+		line.reset();
+	}
+	line.build(big, environ);
+	line.reset();
+	std::size_t made = allocations - before;
+	std::printf("operator new calls over 2001 builds : %zu\n", made);
+	ok = check(made == 0, "build() and reset() never call operator new") && ok;
+	return ok;
+}
+
+// the builtin's output for argv over stdin_text, null when find_builtin() turns argv down
+static const char* run_builtin(std::initializer_list<const char*> words, const char* stdin_text, std::string& out) {
+	std::vector<char*> argv;
+	for(const char* word : words) argv.push_back(const_cast<char*>(word));
+	argv.push_back(nullptr);
+	builtin_fn fn = find_builtin(argv.data());
+	if(!fn) return nullptr;
+
+	Piping in, res;
+	if(!builtins::write_all(in.write_end(), stdin_text, std::strlen(stdin_text))) sys_err("test : write() failed");
+	in.close_write();
+	int rc = fn(in.read_end(), res.write_end(), argv.data());
+	res.close_write();
+	out.clear();
+	char buf[4096];
+	ssize_t n;
+	while((n = builtins::read_some(res.read_end(), buf, sizeof buf)) > 0) out.append(buf, n);
+	return rc == 0 ? out.c_str() : nullptr;
+}
+
+static bool test_builtins() {
+	char path[] = "/tmp/piper-lines-XXXXXX";
+	int fd = mkostemp(path, O_CLOEXEC);
+	if(fd == -1) sys_err("test : mkostemp() failed");
+	static const char text[] = "one two\nthree\nfour five six\n";
+	bool written = builtins::write_all(fd, text, sizeof text - 1);
+	close(fd);
+	if(!written) sys_err("test : write() failed");
+
+	auto same = [](const char* got, std::string_view want) { return got && got == want; };
+	std::string out, want;
+	bool ok = true;
+
+	ok = check(same(run_builtin({"head", "-n", "2", path}, "", out), "one two\nthree\n"), "head -n 2 FILE reads the file") && ok;
+	want = std::string("==> standard input <==\nin\n\n==> ") + path + " <==\none two\n";
+	ok = check(same(run_builtin({"head", "-1", "-", path}, "in\n", out), want), "head on several inputs puts a header on each") && ok;
+	want = std::string("3 ") + path + "\n";
+	ok = check(same(run_builtin({"wc", "-l", path}, "", out), want), "wc -l FILE names the file") && ok;
+	want = std::string("      1       1       3 -\n      3       6      28 ") + path + "\n      4       7      31 total\n";
+	ok = check(same(run_builtin({"wc", "-", path}, "in\n", out), want), "wc on several inputs adds a total") && ok;
+	ok = check(same(run_builtin({"cat", "--", path}, "", out), text), "cat -- FILE reads the file") && ok;
+	std::string missing = std::string(path) + ".missing";
+	want = std::string("in\n") + text;
+	ok = check(!run_builtin({"cat", missing.c_str(), "-", path}, "in\n", out) && out == want,
+		"cat goes on past a FILE it can't open and fails at the end") && ok;
+
+	CommandTable table;
+	auto falls_back = [&table](std::initializer_list<const char*> words) {
+		std::vector<char*> argv;
+		for(const char* word : words) argv.push_back(const_cast<char*>(word));
+		argv.push_back(nullptr);
+		return !find_builtin(argv.data()) && table.resolve(argv[0]) != nullptr;
+	};
+	ok = check(falls_back({"head", "-c", "3"}), "head -c 3 goes to the head binary") && ok;
+	ok = check(falls_back({"cat", "-n", path}), "cat -n FILE goes to the cat binary") && ok;
+	ok = check(falls_back({"wc", "-L"}), "wc -L goes to the wc binary") && ok;
+	ok = check(falls_back({"head", "-n"}), "head -n without a count goes to the head binary") && ok;
+	ok = check(falls_back({"tee", "--append"}), "tee --append goes to the tee binary") && ok;
+	unlink(path);
+	return ok;
+}
+
+// mallocs over rounds launches of line, each one reaped and released before the next
+static std::size_t count_launches(Reaper& reaper, CommandTable& table, const CommandLine& line,
+	const pipe_options& opts, Zygote* zygote, int rounds, bool& clean) {
+	std::size_t before = mallocs.load(std::memory_order_relaxed);
+	for(int i = 0; i < rounds; i++) {
+		std::size_t job = run_pipe(reaper, table, line, opts, nullptr, zygote);
+		const Job& done = reaper.wait(job);
+		for(const auto& st : done.stages)
+			clean = clean && st.done;
+		clean = clean && done.stages.size() == 5 && exit_code(done.stages.back().status) == 0;
+		reaper.release(job);
+	}
+	return mallocs.load(std::memory_order_relaxed) - before;
+}
+
+static bool test_launch() {
+	// forked before the heap grows, like piper does
+	Zygote zygote;
+	Reaper reaper;
+	reaper.attach(zygote);
+	CommandTable table;
+
+	std::vector<std::string_view> words = {"printf", "a\\nb\\nc\\n", "/", "cat", "/", "head", "-n", "2", "/", "wc", "-l", "/", "true"};
+	CommandLine line;
+	line.build(words, environ);
+
+	bool ok = true;
+	for(spawn_mode mode : {spawn_mode::SPAWN, spawn_mode::FORK, spawn_mode::ZYGOTE}) {
+		const char* name = (mode == spawn_mode::SPAWN) ? "spawn" : (mode == spawn_mode::FORK) ? "fork" : "zygote";
+		pipe_options opts;
+		opts.mode = mode;
+		bool clean = true;
+		count_launches(reaper, table, line, opts, &zygote, 3, clean);
+		std::size_t made = count_launches(reaper, table, line, opts, &zygote, 20, clean);
+
+		char what[96];
+		std::snprintf(what, sizeof what, "%s : every stage of 20 launches is reaped, true exits 0", name);
+		ok = check(clean, what) && ok;
+		std::printf("malloc calls over 20 warm %s launches : %zu\n", name, made);
+		std::snprintf(what, sizeof what, "%s : a warm launch never calls malloc()", name);
+		ok = check(made == 0, what) && ok;
+	}
+	line.reset();
+	return ok;
+}
+
+static bool test_missing() {
+	Zygote zygote;
+	Reaper reaper;
+	reaper.attach(zygote);
+	CommandTable table;
+
+	std::vector<std::string_view> words = {"/nonexistent/piper-test", "/", "true"};
+	CommandLine line;
+	line.build(words, environ);
+
+	bool ok = true;
+	for(spawn_mode mode : {spawn_mode::SPAWN, spawn_mode::FORK, spawn_mode::ZYGOTE}) {
+		const char* name = (mode == spawn_mode::SPAWN) ? "spawn" : (mode == spawn_mode::FORK) ? "fork" : "zygote";
+		pipe_options opts;
+		opts.mode = mode;
+		std::size_t job = run_pipe(reaper, table, line, opts, nullptr, &zygote);
+		const Job& done = reaper.wait(job);
+
+		char what[96];
+		std::snprintf(what, sizeof what, "%s : a binary that can't be exec'ed exits 127", name);
+		ok = check(done.stages.size() == 2 && exit_code(done.stages[0].status) == 127, what) && ok;
+		std::snprintf(what, sizeof what, "%s : the stage after it still runs and exits 0", name);
+		ok = check(done.stages.size() == 2 && exit_code(done.stages[1].status) == 0, what) && ok;
+		reaper.release(job);
+	}
+	line.reset();
+	return ok;
+}
+
+static void make_probe(const std::string& path) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+	if(fd == -1) sys_err("test : open() failed");
+	static const char script[] = "#!/bin/sh\n";
+	bool written = builtins::write_all(fd, script, sizeof script - 1);
+	close(fd);
+	if(!written) sys_err("test : write() failed");
+}
+
+static bool test_pathcache() {
+	char root[] = "/tmp/piper-path-XXXXXX";
+	if(!mkdtemp(root)) sys_err("test : mkdtemp() failed");
+	std::string late = std::string(root) + "/late";
+	std::string early = std::string(root) + "/early";
+	if(mkdir(early.c_str(), 0755) == -1) sys_err("test : mkdir() failed");
+	make_probe(early + "/piper-probe");
+
+	// late comes first in PATH and doesn't exist yet, inotify can't watch it
+	std::string path_var = "PATH=" + late + ":" + early;
+	char* env[] = {path_var.data(), nullptr};
+	auto same = [](const char* got, const std::string& want) { return got && got == want; };
+	CommandTable table;
+	bool ok = true;
+
+	ok = check(same(table.resolve("piper-probe", env), early + "/piper-probe"), "PATH comes from the envp given") && ok;
+	ok = check(!table.resolve("piper-probe"), "the process PATH doesn't see the probe") && ok;
+	ok = check(same(table.resolve("piper-probe", env), early + "/piper-probe"), "a lookup is cached") && ok;
+	if(mkdir(late.c_str(), 0755) == -1) sys_err("test : mkdir() failed");
+	make_probe(late + "/piper-probe");
+	ok = check(same(table.resolve("piper-probe", env), late + "/piper-probe"),
+		"a PATH directory created after the lookup shadows the cached entry") && ok;
+
+	unlink((late + "/piper-probe").c_str());
+	rmdir(late.c_str());
+	ok = check(same(table.resolve("piper-probe", env), early + "/piper-probe"), "removing it goes back to the next one") && ok;
+	if(mkdir(late.c_str(), 0755) == -1) sys_err("test : mkdir() failed");
+	make_probe(late + "/piper-probe");
+	ok = check(same(table.resolve("piper-probe", env), late + "/piper-probe"), "and recreating it is noticed again") && ok;
+
+	unlink((late + "/piper-probe").c_str());
+	unlink((early + "/piper-probe").c_str());
+	rmdir(late.c_str());
+	rmdir(early.c_str());
+	rmdir(root);
+	return ok;
+}
+
+int main(int argc, char** argv) {
+	bool teardown = (argc < 2);
+	bool cmdline = (argc < 2);
+	bool builtin = (argc < 2);
+	bool launch = (argc < 2);
+	bool missing = (argc < 2);
+	bool pathcache = (argc < 2);
+	for(int i = 1; i < argc; i++) {
+		if(std::strcmp(argv[i], "--teardown") == 0) teardown = true;
+		else if(std::strcmp(argv[i], "--cmdline") == 0) cmdline = true;
+		else if(std::strcmp(argv[i], "--builtins") == 0) builtin = true;
+		else if(std::strcmp(argv[i], "--launch") == 0) launch = true;
+		else if(std::strcmp(argv[i], "--missing") == 0) missing = true;
+		else if(std::strcmp(argv[i], "--pathcache") == 0) pathcache = true;
+		else {
+			std::fprintf(stderr, "test : unknown option \"%s\"\n", argv[i]);
+			return 2;
+		}
+	}
+
+	bool ok = true;
+	if(cmdline) ok = test_cmdline() && ok;
+	if(builtin) ok = test_builtins() && ok;
+	if(teardown) ok = test_teardown() && ok;
+	if(launch) ok = test_launch() && ok;
+	if(missing) ok = test_missing() && ok;
+	if(pathcache) ok = test_pathcache() && ok;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "piping.hpp"
+
+/*
+Kernel side data movers for stages that only forward bytes.
+Nothing here touches a user-space buffer :
+	pipe <-> anything  = splice()
+	file  -> file      = copy_file_range()
+	pipe  -> pipe      = tee() for duplication
+Every mover reports UNSUPPORTED before consuming anything it can't move,
+so the caller can finish the job with a plain read/write loop.
+*/
+namespace zcopy {
+
+enum class status {
+	DONE,
+	UNSUPPORTED,
+	FAILED
+};
+
+constexpr std::size_t chunk = 1 << 20;
+
+inline bool is_pipe(int fd) noexcept {
+	struct stat st;
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+inline bool is_regular(int fd) noexcept {
+	struct stat st;
+	return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+inline bool unsupported(int err) noexcept {
+	return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+A splice into an O_NONBLOCK pipe is non-blocking on both sides,
+so EAGAIN means either the output is full (a writer stall) or the input is empty.
+*/
+inline void await_splice(int in_fd, int out_fd) noexcept {
+	pollfd out{out_fd, POLLOUT, 0};
+	if(poll(&out, 1, 0) == 0)
+		writer_stalled(out_fd);
+	pollfd in{in_fd, POLLIN, 0};
+	while(poll(&in, 1, -1) == -1 && errno == EINTR);
+}
+
+// moves everything until EOF of in_fd
+inline status forward(int in_fd, int out_fd) noexcept {
+	bool use_splice = is_pipe(in_fd) || is_pipe(out_fd);
+	if(!use_splice && !(is_regular(in_fd) && is_regular(out_fd)))
+		return status::UNSUPPORTED;
+
+	while(true) {
+		ssize_t res = use_splice
+			? splice(in_fd, nullptr, out_fd, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE)
+			: copy_file_range(in_fd, nullptr, out_fd, nullptr, chunk, 0);
+		if(res == 0) return status::DONE;
+		if(res == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) { await_splice(in_fd, out_fd); continue; }
+			return unsupported(errno) ? status::UNSUPPORTED : status::FAILED;
+		}
+	}
+}
+
+/*
+Copies in_fd to out_fd and sink_fd until EOF, in_fd and out_fd must be pipes.
+tee() duplicates the pending bytes into out_fd without consuming them,
+then exactly that many bytes are drained from in_fd into sink_fd.
+If sink_fd can't take a splice the drain degrades to a bounce buffer,
+out_fd already holds those bytes so there is no way back at that point.
+*/
+inline status duplicate(int in_fd, int out_fd, int sink_fd) noexcept {
+	if(!is_pipe(in_fd) || !is_pipe(out_fd))
+		return status::UNSUPPORTED;
+
+	bool sink_splice = true;
+	char bounce[64 * 1024];
+	while(true) {
+		ssize_t res = tee(in_fd, out_fd, chunk, 0);
+		if(res == 0) return status::DONE;
+		if(res == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) { await_splice(in_fd, out_fd); continue; }
+			return unsupported(errno) ? status::UNSUPPORTED : status::FAILED;
+		}
+
+		std::size_t left = res;
+		while(sink_splice && left > 0) {
+			ssize_t moved = splice(in_fd, nullptr, sink_fd, nullptr, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(moved > 0) { left -= moved; continue; }
+			if(moved == -1 && errno == EINTR) continue;
+			if(moved == 0 || !unsupported(errno)) return status::FAILED;
+			sink_splice = false;
+		}
+		while(left > 0) {
+			ssize_t got = read(in_fd, bounce, std::min(left, sizeof bounce));
+			if(got == -1 && errno == EINTR) continue;
+			if(got <= 0) return status::FAILED;
+			for(ssize_t off = 0; off < got;) {
+				ssize_t put = write(sink_fd, bounce + off, got - off);
+				if(put == -1 && errno == EINTR) continue;
+				if(put == -1) return status::FAILED;
+				off += put;
+			}
+			left -= got;
+		}
+	}
+}
+
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include "piping.hpp"
+#include <vector>
+#include <cstring>
+#include <csignal>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+struct zygote_report {
+	enum kind : int {
+		SPAWNED,
+		FAILED,
+		EXITED
+	};
+	kind type;
+	pid_t pid;
+	int value; // raw wait status for EXITED, errno for FAILED
+	struct rusage usage;
+};
+
+// a stage the zygote launched, pidfd is -1 on kernels without pidfd_open
+struct remote_stage {
+	pid_t pid;
+	int pidfd;
+};
+
+// raw syscall, older glibc headers ship pidfd_open without C linkage
+inline int open_pidfd(pid_t pid) noexcept {
+	return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+/*
+A helper forked at startup, while the shell's heap is still tiny.
+Stages are launched by asking the helper over a SOCK_SEQPACKET socket :
+the request carries path, argv and envp, the stdin/stdout fds travel with
+it as SCM_RIGHTS. The helper forks and execs, so launch cost doesn't grow
+with whatever state the shell builds up afterwards.
+
+Stages are the helper's children, so it reaps them and sends an EXITED
+report back over the same socket. The SPAWNED reply carries a pidfd the helper
+opened before it could reap the child, the shell signals through that one. Reports that show up while spawn()
+waits for its own reply are queued and handed out by next_exit().
+*/
+class Zygote {
+	public :
+	Zygote() {
+		int sv[2];
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+			sys_err("Zygote : socketpair() failed");
+
+		int sndbuf = max_request;
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+
+		helper = fork();
+		if(helper == -1) sys_err("Zygote : fork() failed");
+		if(helper == 0) {
+			close(sv[0]);
+			_exit(serve(sv[1]));
+		}
+		close(sv[1]);
+		sock = sv[0];
+	}
+
+	Zygote(const Zygote& _) = delete;
+	Zygote& operator=(const Zygote& _) = delete;
+
+	int fd() const noexcept { return sock; }
+
+	// the caller owns the returned pidfd
+	remote_stage spawn(const char* path, char** argv, char* const* envp, int in_fd, int out_fd) {
+		std::uint32_t counts[2] = {0, 0};
+		req.assign(sizeof counts, '\0');
+		auto put = [this](const char* str) { req.insert(req.end(), str, str + std::strlen(str) + 1); };
+		put(path);
+		for(char** arg = argv; *arg; ++arg, ++counts[0]) put(*arg);
+		for(char* const* env = envp; *env; ++env, ++counts[1]) put(*env);
+		std::memcpy(req.data(), counts, sizeof counts);
+		if(req.size() > max_request) {
+			errno = E2BIG;
+			sys_err("Zygote : spawn() request too large");
+		}
+
+		int fds[2] = {in_fd, out_fd};
+		if(send_fds(sock, req.data(), req.size(), fds) == -1)
+			sys_err("Zygote : spawn() failed to reach the helper");
+
+		zygote_report rep;
+		int pidfd[1] = {-1};
+		while(true) {
+			if(recv_fds(sock, &rep, sizeof rep, pidfd) != sizeof rep)
+				sys_err("Zygote : spawn() lost the helper");
+			if(rep.type == zygote_report::EXITED) {
+				if(exits_head == exits.size()) {
+					exits.clear();
+					exits_head = 0;
+				}
+				exits.push_back(rep);
+				continue;
+			}
+			break;
+		}
+		if(rep.type == zygote_report::FAILED) {
+			errno = rep.value;
+			sys_err(std::string("Zygote : spawn() failed for ") + path);
+		}
+		return {rep.pid, pidfd[0]};
+	}
+
+	/*
+	Next exit report, false once nothing is pending right now.
+	EOF or a socket error means the helper is gone, lost() turns true and
+	no report for its remaining stages will ever come.
+	*/
+	bool next_exit(zygote_report& rep) {
+		if(exits_head < exits.size()) {
+			rep = exits[exits_head++];
+			return true;
+		}
+		while(!gone) {
+			ssize_t n = recv(sock, &rep, sizeof rep, MSG_DONTWAIT);
+			if(n == -1 && errno == EINTR) continue;
+			if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+			if(n != sizeof rep) {
+				gone = true;
+				break;
+			}
+			if(rep.type == zygote_report::EXITED) return true;
+		}
+		return false;
+	}
+
+	bool has_pending() const noexcept { return exits_head < exits.size(); }
+
+	bool lost() const noexcept { return gone; }
+
+	~Zygote() noexcept {
+		// EOF tells the helper to wait for its last children and quit
+		close(sock);
+		waitpid(helper, nullptr, 0);
+	}
+
+	private :
+	static constexpr std::size_t max_request = 1 << 20;
+
+	pid_t helper = -1;
+	int sock = -1;
+	bool gone = false;
+	// both keep their capacity between spawns, a warm shell launches without allocating
+	std::vector<char> req;
+	std::vector<zygote_report> exits; // queued reports start at exits_head
+	std::size_t exits_head = 0;
+
+	template <std::size_t N>
+	static ssize_t send_fds(int sock, const void* buf, std::size_t len, const int (&fds)[N]) noexcept {
+		iovec iov{const_cast<void*>(buf), len};
+		alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof fds)]{};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof ctrl;
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+		ssize_t res;
+		while((res = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+		return res;
+	}
+
+	static void report(int sock, const zygote_report& rep) noexcept {
+		while(send(sock, &rep, sizeof rep, MSG_NOSIGNAL) == -1 && errno == EINTR);
+	}
+
+	static void report(int sock, const zygote_report& rep, int fd) noexcept {
+		if(fd == -1) return report(sock, rep);
+		int fds[1] = {fd};
+		send_fds(sock, &rep, sizeof rep, fds);
+	}
+
+	// helper side, runs until the shell closes its end and every child is reaped
+	static int serve(int sock) {
+		sigset_t chld, old;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &chld, &old);
+		int sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+		if(sfd == -1) return 1;
+
+		std::vector<char> buf(max_request);
+		std::size_t children = 0;
+		bool open = true;
+		while(open || children > 0) {
+			pollfd pfds[2] = {{sfd, POLLIN, 0}, {sock, POLLIN, 0}};
+			if(poll(pfds, open ? 2 : 1, -1) == -1) {
+				if(errno == EINTR) continue;
+				return 1;
+			}
+
+			if(pfds[0].revents) {
+				signalfd_siginfo info;
+				while(read(sfd, &info, sizeof info) > 0);
+				zygote_report rep{zygote_report::EXITED, 0, 0, {}};
+				while((rep.pid = wait4(-1, &rep.value, WNOHANG, &rep.usage)) > 0) {
+					--children;
+					if(open) report(sock, rep);
+				}
+			}
+			if(!open || !pfds[1].revents) continue;
+
+			int fds[2] = {-1, -1};
+			ssize_t n = recv_fds(sock, buf.data(), buf.size(), fds);
+			if(n <= 0) {
+				open = false;
+				continue;
+			}
+
+			pid_t pid = launch(buf.data(), n, fds, old);
+			int err = errno;
+			close(fds[0]);
+			close(fds[1]);
+			if(pid == -1) {
+				report(sock, {zygote_report::FAILED, -1, err, {}});
+				continue;
+			}
+			++children;
+			// nothing reaps before the next poll, so pid is still this child
+			int pidfd = open_pidfd(pid);
+			report(sock, {zygote_report::SPAWNED, pid, 0, {}}, pidfd);
+			if(pidfd != -1) close(pidfd);
+		}
+		return 0;
+	}
+
+	template <std::size_t N>
+	static ssize_t recv_fds(int sock, void* buf, std::size_t len, int (&fds)[N]) noexcept {
+		iovec iov{buf, len};
+		alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof fds)]{};
+		msghdr msg{};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof ctrl;
+
+		ssize_t n;
+		while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+			std::memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+		return n;
+	}
+
+	static pid_t launch(char* req, std::size_t len, const int (&fds)[2], const sigset_t& mask) {
+		std::uint32_t counts[2];
+		if(len <= sizeof counts || req[len - 1] != '\0' || fds[0] == -1 || fds[1] == -1) {
+			errno = EINVAL;
+			return -1;
+		}
+		std::memcpy(counts, req, sizeof counts);
+
+		// strings stay in req, every one of them is null terminated
+		std::vector<char*> ptrs;
+		ptrs.reserve(counts[0] + counts[1] + 3);
+		char* end = req + len;
+		for(char* it = req + sizeof counts; it < end; it += std::strlen(it) + 1)
+			ptrs.push_back(it);
+		if(ptrs.size() != 1 + std::size_t{counts[0]} + counts[1]) {
+			errno = EINVAL;
+			return -1;
+		}
+		ptrs.insert(ptrs.begin() + 1 + counts[0], nullptr);
+		ptrs.push_back(nullptr);
+		char** argv = ptrs.data() + 1;
+		char** envp = argv + counts[0] + 1;
+
+		pid_t pid = fork();
+		if(pid != 0) return pid;
+
+		sigprocmask(SIG_SETMASK, &mask, nullptr);
+		dup2(fds[0], STDIN_FILENO);
+		dup2(fds[1], STDOUT_FILENO);
+		execve(ptrs.front(), argv, envp);
+		perror("Zygote : execve() failed");
+		_exit(127);
+	}
+};